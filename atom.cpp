@@ -23,9 +23,14 @@
 #include "atom.h"
 
 #include <map>
+#include <deque>
+#include <algorithm>  //for: min(), max()
 #include <iostream>
+#include <limits>
 
 #include <cstring>      //for: memcpy()
+#include <cstdio>       //for: sprintf()
+#include <cstdlib>      //for: posix_memalign(), free()
 #include <cassert>
 
 using namespace std;
@@ -68,90 +73,305 @@ namespace {
     }
 
 
-    // Atom definitions map.
+    // Atom definitions.
     static inline uint32_t id2Key(const char *id) {
         const unsigned char *uid = reinterpret_cast<const unsigned char*>(id);
         return ((uint32_t(uid[0]) << 24) | (uint32_t(uid[1]) << 16) | (uint32_t(uid[2]) << 8) | uid[3]);
     }
 
-    AtomDefinition definition(const char *id) {
-        static const AtomDefinition def_unknown = KnownAtoms[0];
-        static map<uint32_t, AtomDefinition> def;
-        if(def.empty()) {
+    // Hash table (open addressing) of the known atoms, filled during static
+    //  initialization and read only afterwards: lookups need no lock.
+    class AtomDefinitions {
+    public:
+        AtomDefinitions() {
+            for(unsigned int i = 0; i < TableSize; ++i)
+                table[i] = NULL;
+            //for each atom name include the last of multiple definitions
             for(unsigned int i = 1; i < sizeof(KnownAtoms)/sizeof(KnownAtoms[0]); ++i) {
-#if 1
-                //for each atom name include the last of multiple definitions
-                def[id2Key(KnownAtoms[i].known_atom_name)] = KnownAtoms[i];
-#else
-                //for each atom name include only the first of multiple definitions
-                def.insert(make_pair(id2Key(KnownAtoms[i].known_atom_name), KnownAtoms[i]));
-#endif
+                uint32_t key = id2Key(KnownAtoms[i].known_atom_name);
+                unsigned int n = slot(key);
+                keys[n]  = key;
+                table[n] = &KnownAtoms[i];
             }
         }
 
-        if(id) {
-            map<uint32_t, AtomDefinition>::const_iterator it = def.find(id2Key(id));
-            if(it != def.end())
-                return it->second;
+        const AtomDefinition &find(const char *id) const {
+            if(id) {
+                const AtomDefinition *def = table[slot(id2Key(id))];
+                if(def)
+                    return *def;
+            }
+            return KnownAtoms[0];
+        }
+
+    private:
+        enum { TableBits = 9, TableSize = 1 << TableBits };  //over twice the known atoms
+        uint32_t              keys [TableSize];
+        const AtomDefinition *table[TableSize];
+
+        //the slot of key, or the empty one where it would go
+        unsigned int slot(uint32_t key) const {
+            unsigned int n = (key * 2654435761U) >> (32 - TableBits);
+            while(table[n] && keys[n] != key)
+                n = (n + 1) & (TableSize - 1);
+            return n;
+        }
+    };
+
+    const AtomDefinitions definitions;
+
+    inline const AtomDefinition &definition(const char *id) {
+        return definitions.find(id);
+    }
+
+    //atom names can have any byte (i.e. '\xA9nam')
+    void printJsonString(ostream &out, const char *str) {
+        out << '"';
+        for(const unsigned char *p = reinterpret_cast<const unsigned char *>(str); *p; ++p) {
+            if(*p == '"' || *p == '\\') {
+                out << '\\' << char(*p);
+            } else if(*p < 0x20 || *p >= 0x7F) {
+                char code[8];
+                sprintf(code, "\\u%04x", *p);
+                out << code;
+            } else
+                out << char(*p);
         }
-        return def_unknown;
+        out << '"';
     }
+
+    //larger atoms need a 64-bit length
+    const int64_t MaxLength32 = 0xFFFFFFFFLL;
 }; //namespace
 
 
 
+// AtomArena
+AtomArena::AtomArena(Atom *root) : used(BlockSize), root(root), indexed(false) { }
+
+AtomArena::~AtomArena() {
+    //children from outside (i.e. a repaired mdat) are deleted, the rest go with their block
+    for(unsigned int b = 0; b < blocks.size(); b++) {
+        int n = BlockSize;
+        if(b + 1 == blocks.size())
+            n = used;
+        for(int i = 0; i < n; i++) {
+            vector<Atom *> &children = blocks[b][i].children;
+            for(unsigned int c = 0; c < children.size(); c++)
+                if(!children[c]->pooled)
+                    delete children[c];
+            children.clear();
+        }
+    }
+    for(unsigned int b = 0; b < blocks.size(); b++)
+        delete[] blocks[b];
+}
+
+Atom *AtomArena::create() {
+    if(used == BlockSize) {
+        blocks.push_back(new Atom[BlockSize]);
+        used = 0;
+    }
+    Atom *atom   = &blocks.back()[used++];
+    atom->arena  = this;
+    atom->pooled = true;
+    return atom;
+}
+
+const vector<Atom *> &AtomArena::find(uint32_t id) {
+    if(!indexed) {
+        index.clear();
+        int64_t order = 0;
+        number(root, order, Stride);
+        add(root);
+        indexed = true;
+    }
+    map<uint32_t, vector<Atom *> >::const_iterator it = index.find(id);
+    if(it == index.end()) {
+        static const vector<Atom *> none;
+        return none;
+    }
+    return it->second;
+}
+
+void AtomArena::inserted(Atom *atom) {
+    if(!indexed)
+        return;
+    //orders between the atom before it in pre-order and the one after
+    Atom *parent = atom->parent;
+    vector<Atom *> &siblings = parent->children;
+    size_t i = std::find(siblings.begin(), siblings.end(), atom) - siblings.begin();
+    int64_t lo = parent->order;
+    int64_t hi = parent->order_end;
+    if(i > 0) {
+        Atom *last = siblings[i - 1];
+        while(!last->children.empty())
+            last = last->children.back();
+        lo = last->order;
+    }
+    if(i + 1 < siblings.size())
+        hi = siblings[i + 1]->order;
+
+    int64_t count = 0;
+    vector<Atom *> stack(1, atom);
+    while(!stack.empty()) {
+        Atom *a = stack.back();
+        stack.pop_back();
+        count++;
+        stack.insert(stack.end(), a->children.begin(), a->children.end());
+    }
+    int64_t stride = (hi - lo) / (count + 1);
+    if(stride > 0) {
+        int64_t order = lo + stride;
+        number(atom, order, stride);
+    } else {  //no room left: the order of the others doesn't change, the index stays sorted
+        int64_t order = 0;
+        number(root, order, Stride);
+    }
+    add(atom);
+}
+
+void AtomArena::removed(Atom *atom) {
+    if(!indexed)
+        return;
+    map<uint32_t, vector<Atom *> >::iterator it = index.find(id2Key(atom->name));
+    if(it != index.end()) {
+        vector<Atom *> &list = it->second;
+        vector<Atom *>::iterator pos = lower_bound(list.begin(), list.end(), atom, before);
+        if(pos != list.end() && *pos == atom)
+            list.erase(pos);
+    }
+    for(unsigned int i = 0; i < atom->children.size(); i++)
+        removed(atom->children[i]);
+}
+
+void AtomArena::number(Atom *atom, int64_t &order, int64_t stride) {
+    atom->order = order;
+    order += stride;
+    for(unsigned int i = 0; i < atom->children.size(); i++)
+        number(atom->children[i], order, stride);
+    atom->order_end = order;
+}
+
+void AtomArena::add(Atom *atom) {
+    vector<Atom *> &list = index[id2Key(atom->name)];
+    list.insert(lower_bound(list.begin(), list.end(), atom, before), atom);
+    for(unsigned int i = 0; i < atom->children.size(); i++)
+        add(atom->children[i]);
+}
+
+bool AtomArena::before(const Atom *a, const Atom *b) {
+    return a->order < b->order;
+}
+
+
+
 // Atom
-Atom::Atom() : start(0), length(0), name(""), head(""), version("") { }
+Atom::Atom() : start(0), length(0), name(""), head(""), version(""), parent(NULL),
+    source(NULL), source_size(0), dirty(true), arena(NULL), pooled(false), order(0), order_end(0) { }
 
 Atom::~Atom() {
     for(unsigned int i = 0; i < children.size(); i++)
-        delete children[i];
+        if(!children[i]->pooled)
+            delete children[i];
+    if(!pooled)
+        delete arena;
 }
 
+//the name is needed for the index: children parsed later are added before the tree is searched
+Atom *Atom::addChild(const char *name) {
+    if(!arena)
+        arena = new AtomArena(this);
+    Atom *atom = arena->create();
+    strncpy(atom->name, name, 4);
+    atom->parent = this;
+    children.push_back(atom);
+    arena->inserted(atom);
+    touch();
+    return atom;
+}
 
-void Atom::parseHeader(File &file) {
-    start = file.pos();
-    length = file.readInt();
-    file.readChar(name, 4);
+//the length must be updated, and so must the lengths of the ancestors
+void Atom::touch() {
+    for(Atom *atom = this; atom && !atom->dirty; atom = atom->parent)
+        atom->dirty = true;
+}
+
+//atoms in an arena only release their content, the memory is freed with the tree
+void Atom::destroy(Atom *atom) {
+    if(!atom)
+        return;
+    if(!atom->pooled) {
+        delete atom;
+        return;
+    }
+    for(unsigned int i = 0; i < atom->children.size(); i++)
+        destroy(atom->children[i]);
+    atom->children.clear();
+    vector<unsigned char>().swap(atom->content);
+    atom->source = NULL;
+}
+
+
+void Atom::parseHeader(File &file, int64_t offset) {
+    uint8_t header[8];
+    if(file.readAt(offset, header, 8) != 8)
+        throw string("Could not read atom length");
+    start  = offset;
+    length = readBE<uint32_t>(header);
+    memcpy(name, header + 4, 4);
 
     if(length == 1) {
-        length = file.readInt64() - 8;
+        if(file.readAt(offset + 8, header, 8) != 8)
+            throw string("Could not read atom length");
+        length = readBE<int64_t>(header) - 8;
         start += 8;
     } else if(length == 0) {
-        length = file.length() - start;
+        //extends to the end of the file, unknown for streams
+        if(file.length() >= 0)
+            length = file.length() - start;
+        else
+            length = numeric_limits<int64_t>::max() - start;
     }
+    if(length < 8)
+        throw string("Invalid atom length: ") + name;
 }
 
-void Atom::parse(File &file) {
-    parseHeader(file);
+void Atom::parse(File &file, int64_t offset) {
+    parseHeader(file, offset);
 
     if(isParent(name) && name != string("udta")) { //user data atom is dangerous... i should actually skip all
-        while(file.pos() < start + length) {
-            Atom *atom = new Atom;
-            atom->parse(file);
-            children.push_back(atom);
+        int64_t pos = start + 8;
+        while(pos < start + length) {
+            Atom *atom = addChild();
+            atom->parse(file, pos);
+            pos = atom->start + atom->length;
         }
-        assert(file.pos() == start + length);
+        assert(pos == start + length);
 
     } else {
-        content = file.read(length -8); //length includes header
-        if(content.size() < length -8)
-            throw string("Failed reading atom content: ") + name;
+        //most of the content (i.e. mdat) is only copied or never used: don't read it yet
+        content.clear();
+        source      = &file;
+        source_size = length -8; //length includes header
     }
+
+    //the length is right, unless it was read without its 64-bit header
+    dirty = (start != offset);
+    for(unsigned int i = 0; i < children.size() && !dirty; i++)
+        dirty = children[i]->dirty;
 }
 
+//the whole subtree goes out in one gathered write, straight from the contents
 void Atom::write(File &file) {
-    //1 write length
 #ifndef NDEBUG
     off_t begin = file.pos();
 #endif
 
-    file.writeInt(length);
-    file.writeChar(name, 4);
-    if(!content.empty())
-        file.write(content);
-    for(unsigned int i = 0; i < children.size(); i++)
-        children[i]->write(file);
+    vector<File::Buffer> buffers;
+    deque<Header>        headers;
+    gather(file, buffers, headers);
+    writeBuffers(file, buffers);
 
 #ifndef NDEBUG
     off_t end = file.pos();
@@ -159,6 +379,58 @@ void Atom::write(File &file) {
 #endif
 }
 
+//add the layout of the subtree to buffers; content neither loaded nor mapped
+// is copied at its place, after writing the buffers before it
+void Atom::gather(File &file, vector<File::Buffer> &buffers, deque<Header> &headers) {
+    headers.push_back(Header());
+    File::Buffer header = { headers.back().data, size_t(encodeHeader(headers.back().data)) };
+    buffers.push_back(header);
+
+    if(source) {
+        const unsigned char *data = source->map(start + 8, source_size);
+        if(data) {
+            File::Buffer buffer = { data, size_t(source_size) };
+            buffers.push_back(buffer);
+        } else {
+            writeBuffers(file, buffers);
+            if(file.copy(*source, start + 8, source_size) != source_size)
+                throw string("Failed copying atom content: ") + name;
+        }
+    } else if(!content.empty()) {
+        File::Buffer buffer = { &content[0], content.size() };
+        buffers.push_back(buffer);
+    }
+    for(unsigned int i = 0; i < children.size(); i++)
+        children[i]->gather(file, buffers, headers);
+}
+
+void Atom::writeBuffers(File &file, vector<File::Buffer> &buffers) {
+    if(!buffers.empty() && file.writeGather(buffers) < 0)
+        throw string("Failed writing atom: ") + name;
+    buffers.clear();
+}
+
+//length and name, with a 64-bit length if needed (length includes the header)
+void Atom::writeHeader(File &file) {
+    unsigned char header[16];
+    file.writeChar(reinterpret_cast<const char *>(header), encodeHeader(header));
+}
+
+int Atom::encodeHeader(unsigned char *header) const {
+    memcpy(header + 4, name, 4);
+    if(length > MaxLength32) {
+        writeBE(header, uint32_t(1));
+        writeBE(header + 8, length);
+        return 16;
+    }
+    writeBE(header, uint32_t(length));
+    return 8;
+}
+
+int Atom::headerSize() const {
+    return (length > MaxLength32) ? 16 : 8;
+}
+
 void Atom::print(int offset) {
     string indent(offset, ' ');
 
@@ -261,47 +533,169 @@ void Atom::print(int offset) {
 }
 
 
+//one object per atom, written as the tables are read: no table is kept in memory
+void Atom::printJson(ostream &out) {
+    out << "{\"name\":";
+    printJsonString(out, name);
+    out << ",\"start\":" << start << ",\"length\":" << length;
+
+    //entries of a table, as many as the content holds
+    int64_t size = contentSize();
+    int entries = (size >= 8) ? readInt(4) : 0;
+    int64_t room = 0;
+
+    if((name == string("mvhd") || name == string("mdhd")) && size >= 20) {
+        out << ",\"timescale\":" << readInt(12) << ",\"duration\":" << readInt(16);
+
+    } else if(name == string("tkhd") && size >= 24) {
+        out << ",\"track\":" << readInt(12) << ",\"duration\":" << readInt(20);
+
+    } else if(name == string("hdlr") && size >= 12) {
+        char type[5];
+        readChar(type, 8, 4);
+        out << ",\"type\":";
+        printJsonString(out, type);
+
+    } else if(name == string("stsd") && size >= 16) {
+        char type[5];
+        readChar(type, 12, 4);
+        out << ",\"entries\":" << entries << ",\"codec\":";
+        printJsonString(out, type);
+
+    } else if(name == string("stts") && size >= 8) {
+        room = (size - 8) / 8;
+        out << ",\"times\":[";
+        for(int i = 0; i < entries && i < room; i++)
+            out << (i ? ",[" : "[") << uint32_t(readInt(8 + 8*i)) << ',' << uint32_t(readInt(12 + 8*i)) << ']';
+        out << ']';
+
+    } else if(name == string("stss") && size >= 8) {
+        room = (size - 8) / 4;
+        out << ",\"keyframes\":[";
+        for(int i = 0; i < entries && i < room; i++)
+            out << (i ? "," : "") << uint32_t(readInt(8 + 4*i));
+        out << ']';
+
+    } else if(name == string("stsc") && size >= 8) {
+        room = (size - 8) / 12;
+        out << ",\"chunks\":[";
+        for(int i = 0; i < entries && i < room; i++)
+            out << (i ? ",[" : "[") << uint32_t(readInt( 8 + 12*i))
+                << ',' << uint32_t(readInt(12 + 12*i))
+                << ',' << uint32_t(readInt(16 + 12*i)) << ']';
+        out << ']';
+
+    } else if(name == string("stsz") && size >= 12) {
+        int sample_size = readInt(4);
+        entries = readInt(8);
+        room = (size - 12) / 4;
+        out << ",\"sample_size\":" << sample_size << ",\"entries\":" << entries;
+        if(sample_size == 0) {
+            out << ",\"sizes\":[";
+            for(int i = 0; i < entries && i < room; i++)
+                out << (i ? "," : "") << uint32_t(readInt(12 + 4*i));
+            out << ']';
+        }
+
+    } else if(name == string("stco") && size >= 8) {
+        room = (size - 8) / 4;
+        out << ",\"offsets\":[";
+        for(int i = 0; i < entries && i < room; i++)
+            out << (i ? "," : "") << uint32_t(readInt(8 + 4*i));
+        out << ']';
+
+    } else if(name == string("co64") && size >= 8) {
+        room = (size - 8) / 8;
+        out << ",\"offsets\":[";
+        for(int i = 0; i < entries && i < room; i++)
+            out << (i ? "," : "") << readInt64(8 + 8*i);
+        out << ']';
+    }
+
+    if(!children.empty()) {
+        out << ",\"children\":[";
+        for(unsigned int i = 0; i < children.size(); i++) {
+            if(i) out << ',';
+            children[i]->printJson(out);
+        }
+        out << ']';
+    }
+    out << '}';
+}
+
+
 bool Atom::isParent(const char *id) {
-    AtomDefinition def = definition(id);
+    const AtomDefinition &def = definition(id);
     return def.container_state == PARENT_ATOM;// || def.container_state == DUAL_STATE_ATOM;
 }
 
 bool Atom::isDual(const char *id) {
-    AtomDefinition def = definition(id);
+    const AtomDefinition &def = definition(id);
     return def.container_state == DUAL_STATE_ATOM;
 }
 
 bool Atom::isVersioned(const char *id) {
-    AtomDefinition def = definition(id);
+    const AtomDefinition &def = definition(id);
     return def.box_type == VERSIONED_ATOM;
 }
 
+bool Atom::isKnown(const char *id) {
+    return &definition(id) != &KnownAtoms[0];
+}
+
 
-vector<Atom *> Atom::atomsByName(string name) const {
+vector<Atom *> Atom::atomsByName(const char *name) const {
     vector<Atom *> atoms;
-    for(unsigned int i = 0; i < children.size(); i++) {
-        if(children[i]->name == name)
-            atoms.push_back(children[i]);
-        vector<Atom *> a = children[i]->atomsByName(name);
-        atoms.insert(atoms.end(), a.begin(), a.end());
-    }
+    findByName(name, atoms, false);
     return atoms;
 }
 
-Atom *Atom::atomByName(string name) const {
-    for(unsigned int i = 0; i < children.size(); i++) {
-        if(children[i]->name == name)
-            return children[i];
-        Atom *a = children[i]->atomByName(name);
-        if(a) return a;
+Atom *Atom::atomByName(const char *name) const {
+    vector<Atom *> atoms;
+    findByName(name, atoms, true);
+    return atoms.empty() ? NULL : atoms[0];
+}
+
+void Atom::findByName(const char *name, vector<Atom *> &atoms, bool first) const {
+    if(!arena) {  //not in a tree with an index (i.e. a repaired mdat)
+        for(unsigned int i = 0; i < children.size(); i++) {
+            if(id2Key(children[i]->name) == id2Key(name)) {
+                atoms.push_back(children[i]);
+                if(first) return;
+            }
+            children[i]->findByName(name, atoms, first);
+            if(first && !atoms.empty()) return;
+        }
+        return;
+    }
+
+    //the descendants are the atoms after this one in pre-order, up to order_end
+    const vector<Atom *> &list = arena->find(id2Key(name));
+    size_t lo = 0, hi = list.size();
+    while(lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if(list[mid]->order <= order)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for(; lo < list.size() && list[lo]->order < order_end; ++lo) {
+        atoms.push_back(list[lo]);
+        if(first) return;
     }
-    return NULL;
 }
 
 void Atom::replace(Atom *original, Atom *replacement) {
     for(unsigned int i = 0; i < children.size(); i++) {
         if(children[i] == original) {
+            if(arena)
+                arena->removed(original);
             children[i] = replacement;
+            replacement->parent = this;
+            replacement->touch();
+            touch();
+            if(arena)
+                arena->inserted(replacement);
             return;
         }
     }
@@ -309,66 +703,110 @@ void Atom::replace(Atom *original, Atom *replacement) {
 }
 
 
-void Atom::prune(string name) {
-    if(children.empty()) return;
-
-    length = 8;
-
-    vector<Atom *>::iterator it = children.begin();
-    while(it != children.end()) {
-        Atom *child = *it;
-        if(name == child->name) {
-            delete child;
-            it = children.erase(it);
-        } else {
-            child->prune(name);
-            length += child->length;
-            ++it;
-        }
+//removes the atoms with this name from the subtree
+void Atom::prune(const char *name) {
+    vector<Atom *> atoms = atomsByName(name);
+    for(unsigned int i = 0; i < atoms.size(); i++) {
+        Atom *atom = atoms[i];
+        vector<Atom *> &siblings = atom->parent->children;
+        vector<Atom *>::iterator it = find(siblings.begin(), siblings.end(), atom);
+        if(it == siblings.end())
+            continue;  //inside an atom already pruned
+        if(arena)
+            arena->removed(atom);
+        siblings.erase(it);
+        atom->parent->touch();
+        destroy(atom);
     }
 }
 
+//recomputes only the lengths of the atoms changed since the last update
 void Atom::updateLength() {
+    if(!dirty)
+        return;
     length = 8;
-    length += content.size();
+    length += contentSize();
 
     for(unsigned int i = 0; i < children.size(); i++) {
         Atom *child = children[i];
         child->updateLength();
         length += child->length;
     }
+    if(length > MaxLength32)
+        length += 8;  //64-bit header
+    dirty = false;
 }
 
 
 void Atom::contentResize(size_t newsize) {
+    load();
+    if(newsize != content.size())
+        touch();
     content.resize(newsize);
 }
 
+const unsigned char *Atom::contentData(int64_t offset, int64_t size) {
+    assert(offset >= 0 && size >= 0 && contentSize() >= offset + size);
+    if(source) {
+        const unsigned char *data = source->map(start + 8 + offset, size);
+        if(data)
+            return data;
+        load();
+    }
+    return content.empty() ? NULL : &content[offset];
+}
+
+//read the content from the file, before it's changed
+void Atom::load() {
+    if(!source) return;
+    File *file = source;
+    source = NULL;
+    content.resize(source_size);
+    if(!content.empty() && file->readAt(start + 8, &content[0], content.size()) != ssize_t(content.size()))
+        throw string("Failed reading atom content: ") + name;
+}
+
+//a few bytes of content, without loading all of it
+const unsigned char *Atom::peek(int64_t offset, int64_t size, unsigned char *buf) {
+    assert(offset >= 0 && size >= 0 && contentSize() >= offset + size);
+    if(!source)
+        return &content[offset];
+    const unsigned char *data = source->map(start + 8 + offset, size);
+    if(data)
+        return data;
+    if(source->readAt(start + 8 + offset, buf, size) != ssize_t(size))
+        throw string("Failed reading atom content: ") + name;
+    return buf;
+}
+
 
 int32_t Atom::readInt(int64_t offset) {
-    assert(offset >= 0 && content.size() >= uint64_t(offset) + 4);
-    return readBE<int32_t>(&content[offset]);
+    unsigned char buf[4];
+    return readBE<int32_t>(peek(offset, 4, buf));
 }
 
 int64_t Atom::readInt64(int64_t offset) {
-    assert(offset >= 0 && content.size() >= uint64_t(offset) + 8);
-    return readBE<int64_t>(&content[offset]);
+    unsigned char buf[8];
+    return readBE<int64_t>(peek(offset, 8, buf));
 }
 
 void Atom::writeInt(int32_t value, int64_t offset) {
+    load();
     assert(offset >= 0 && content.size() >= uint64_t(offset) + 4);
     writeBE(&content[offset], value);
 }
 
 void Atom::writeInt64(int64_t value, int64_t offset) {
+    load();
     assert(offset >= 0 && content.size() >= uint64_t(offset) + 8);
     writeBE(&content[offset], value);
 }
 
 void Atom::readChar(char *str, int64_t offset, int64_t length) {
     assert(str != NULL);
-    assert(offset >= 0 && length >= 0 && content.size() >= uint64_t(offset) + uint64_t(length));
-    const unsigned char *p = &content[offset];
+    assert(offset >= 0 && length >= 0 && contentSize() >= offset + length);
+    vector<unsigned char> buf(length);
+    const unsigned char *p = length ? peek(offset, length, &buf[0]) : NULL;
     for(long int i = 0; i < length; i++)
         *str++ = *p++;
     *str = '\0';
@@ -377,31 +815,64 @@ void Atom::readChar(char *str, int64_t offset, int64_t length) {
 
 
 // BufferedAtom
-BufferedAtom::BufferedAtom(string filename)
+BufferedAtom::BufferedAtom(string filename, int file_flags)
   : file_begin(0),
     file_end(0),
+    file(NULL),
     buffer(NULL),
     buffer_begin(0),
-    buffer_end(0)
+    buffer_end(0),
+    prefetch_end(0)
 {
-    if(!file.open(filename))
+    file = new File;
+    if(!file->open(filename, file_flags)) {
+        delete file;
         throw string("Could not open file");
+    }
 }
 
+BufferedAtom::BufferedAtom(File *file)
+  : file_begin(0),
+    file_end(0),
+    file(file),
+    buffer(NULL),
+    buffer_begin(0),
+    buffer_end(0),
+    prefetch_end(0)
+{ }
+
 BufferedAtom::~BufferedAtom() {
-    delete[] buffer;
+    if(windowed())
+        free(buffer);
+    else
+        delete[] buffer;
+    delete file;
 }
 
 
-unsigned char *BufferedAtom::getFragment(int64_t offset, int64_t size) {
+const unsigned char *BufferedAtom::getFragment(int64_t offset, int64_t size) {
     assert(size >= 0);
     if(offset < 0)
         throw string("Offset set before beginning of buffer");
     if(offset + size > file_end - file_begin)
         throw string("Out of buffer");
 
+    if(windowed()) {
+        readWindow(offset, size);
+        if(buffer_end < offset + size)
+            throw string("Could not read chars");
+        return buffer + (offset - buffer_begin);
+    }
+
+    readAhead(offset + size);
+
+    //no copy needed if the file is mapped
+    const unsigned char *mapped = file->map(file_begin + offset, size);
+    if(mapped)
+        return mapped;
+
     if(buffer) {
-        if(buffer_begin >= offset && buffer_end >= offset + size)
+        if(buffer_begin <= offset && buffer_end >= offset + size)
             return buffer + (offset - buffer_begin);
 
         //reallocate and reread
@@ -414,11 +885,72 @@ unsigned char *BufferedAtom::getFragment(int64_t offset, int64_t size) {
     if(buffer_end + file_begin > file_end)
         buffer_end = file_end - file_begin;
     buffer = new unsigned char[buffer_end - buffer_begin];
-    file.seek(file_begin + buffer_begin);
-    file.readChar((char *)buffer, buffer_end - buffer_begin);
+    if(file->readAt(file_begin + buffer_begin, buffer, buffer_end - buffer_begin) != buffer_end - buffer_begin)
+        throw string("Could not read chars");
     return buffer;
 }
 
+//direct I/O and streams: read large windows into one fixed buffer, keeping what is still needed
+void BufferedAtom::readWindow(int64_t offset, int64_t size) {
+    const int64_t align  = file->isDirect() ? int64_t(File::DirectAlignment) : 1;
+    const int64_t window = 64 << 20;
+
+    if(buffer && buffer_begin <= offset && buffer_end >= offset + size)
+        return;
+    if(size > window - align)
+        throw string("Fragment too large for the read window");
+
+    if(!buffer) {
+        void *p = NULL;
+        if(posix_memalign(&p, File::DirectAlignment, window) != 0)
+            throw string("Could not allocate read window");
+        buffer = static_cast<unsigned char *>(p);
+        buffer_begin = buffer_end = 0;
+    }
+
+    //buffer_begin is relative to file_begin, but aligned in the file
+    int64_t begin = (file_begin + offset) / align * align - file_begin;
+    int64_t kept  = 0;
+    if(begin >= buffer_begin && begin < buffer_end && (buffer_end - begin) % align == 0) {
+        kept = buffer_end - begin;
+        memmove(buffer, buffer + (begin - buffer_begin), kept);
+    }
+    buffer_begin = begin;
+    buffer_end   = begin + kept;
+
+    ssize_t len = file->readAt(file_begin + buffer_end, buffer + kept, window - kept);
+    if(len > 0)
+        buffer_end += len;
+    //a short read means the stream ended
+    if(file->isStream() && len < window - kept && file_end > file_begin + buffer_end)
+        file_end = file_begin + buffer_end;
+}
+
+int64_t BufferedAtom::readable(int64_t offset, int64_t size) {
+    if(file->isStream() && offset < file_end - file_begin)
+        readWindow(offset, min(size, file_end - file_begin - offset));
+    return max(int64_t(0), min(size, file_end - file_begin - offset));
+}
+
+int64_t BufferedAtom::nextData(int64_t offset) {
+    int64_t data = file->nextData(file_begin + offset) - file_begin;
+    return min(max(data, offset), file_end - file_begin);
+}
+
+//keep the next few windows after offset being read while the current one is parsed
+void BufferedAtom::readAhead(int64_t offset) {
+    const int64_t window  = 16 << 20;
+    const int64_t windows = 4;
+
+    if(prefetch_end >= offset + (windows - 1) * window)
+        return;
+    int64_t begin = max(prefetch_end, offset);
+    int64_t end   = min(offset + windows * window, file_end - file_begin);
+    if(end > begin)
+        file->prefetch(file_begin + begin, end - begin);
+    prefetch_end = end;
+}
+
 void BufferedAtom::updateLength() {
     length  = 8;
     length += file_end - file_begin;
@@ -428,6 +960,8 @@ void BufferedAtom::updateLength() {
         child->updateLength();
         length += child->length;
     }
+    if(length > MaxLength32)
+        length += 8;  //64-bit header
 }
 
 
@@ -438,39 +972,43 @@ void BufferedAtom::contentResize(size_t newsize) {
 
 
 int32_t BufferedAtom::readInt(int64_t offset) {
+    const unsigned char *mapped = (offset + 4 <= file_end - file_begin) ? file->map(file_begin + offset, 4) : NULL;
+    if(mapped)
+        return readNE<int32_t>(mapped);
+
     if(!buffer || offset < buffer_begin || offset > (buffer_end - 4)) {
-        buffer = getFragment(offset, 1<<16);
+        getFragment(offset, 1<<16);
     }
     return readNE<int32_t>(buffer + offset - buffer_begin);
 }
 
 int64_t BufferedAtom::readInt64(int64_t offset) {
+    const unsigned char *mapped = (offset + 8 <= file_end - file_begin) ? file->map(file_begin + offset, 8) : NULL;
+    if(mapped)
+        return readNE<int64_t>(mapped);
+
     if(!buffer || offset < buffer_begin || offset > (buffer_end - 8)) {
-        buffer = getFragment(offset, 1<<16);
+        getFragment(offset, 1<<16);
     }
     return readNE<int64_t>(buffer + offset - buffer_begin);
 }
 
 
+//the content is copied from the file, not gathered
+void BufferedAtom::gather(File &output, vector<File::Buffer> &buffers, deque<Header> &/*headers*/) {
+    writeBuffers(output, buffers);
+    write(output);
+}
+
 void BufferedAtom::write(File &output) {
     //1 write length
 #ifndef NDEBUG
     off_t begin = output.pos();
 #endif
 
-    output.writeInt(length);
-    output.writeChar(name, 4);
-    char buff[1<<20];
-    int64_t offset = file_begin;
-    file.seek(file_begin);
-    while(offset < file_end) {
-        int64_t toread = 1<<20;
-        if(toread + offset > file_end)
-            toread = file_end - offset;
-        file.readChar(buff, toread);
-        offset += toread;
-        output.writeChar(buff, toread);
-    }
+    writeHeader(output);
+    if(output.copy(*file, file_begin, file_end - file_begin) != file_end - file_begin)
+        throw string("Failed writing atom content: ") + name;
     for(unsigned int i = 0; i < children.size(); i++)
         children[i]->write(output);
 
@@ -27,10 +27,51 @@ extern "C" {
 }
 #include <vector>
 #include <string>
+#include <map>
+#include <deque>
+#include <iosfwd>
 
 #include "file.h"
 
 
+class Atom;
+
+// Storage for the atoms of a parsed tree: a few blocks instead of an
+//  allocation per atom, all freed together with the tree.
+// Also indexes the atoms of the tree by name, for atomByName().
+class AtomArena {
+public:
+    explicit AtomArena(Atom *root);
+    ~AtomArena();
+
+    Atom *create();
+
+    //atoms of the tree with this name, in pre-order
+    const std::vector<Atom *> &find(uint32_t id);
+    //keep the index up to date: after atom (and its subtree) is put in the tree, before it's taken out
+    void inserted(Atom *atom);
+    void removed (Atom *atom);
+
+private:
+    static const int BlockSize = 256;
+    static const int64_t Stride = 1 << 16;  //room between the orders for atoms added later
+    std::vector<Atom *> blocks;
+    int used;  //atoms in the last block
+
+    Atom *root;
+    std::map<uint32_t, std::vector<Atom *> > index;
+    bool  indexed;
+
+    void number(Atom *atom, int64_t &order, int64_t stride);
+    void add   (Atom *atom);
+    static bool before(const Atom *a, const Atom *b);
+
+    // Disable copying.
+    AtomArena(const AtomArena&);
+    AtomArena& operator=(const AtomArena&);
+};
+
+
 class Atom {
 public:
     int64_t start;       //including 8 header bytes
@@ -38,30 +79,41 @@ public:
     char    name[5];
     char    head[4];
     char    version[4];
-    std::vector<unsigned char> content;
     std::vector<Atom *> children;
+    Atom   *parent;      //NULL for the root
 
     Atom();
     virtual ~Atom();
 
-    void parseHeader  (File &file); //read just name and length
-    void parse        (File &file);
+    void parseHeader  (File &file, int64_t offset); //read just name and length
+    void parse        (File &file, int64_t offset); //content is read when used: file must stay open
     virtual void write(File &file);
+    void writeHeader(File &file);
+    int  headerSize() const;  //8, or 16 for a 64-bit length
     void print(int offset);
+    void printJson(std::ostream &out);  //with the complete sample tables, streamed
 
-    std::vector<Atom *> atomsByName(std::string name) const;
-    Atom *              atomByName (std::string name) const;
+    //descendants in pre-order, found through the index of the tree
+    std::vector<Atom *> atomsByName(const char *name) const;
+    Atom *              atomByName (const char *name) const;
     void replace(Atom *original, Atom *replacement);
 
-    void prune(std::string name);
-    virtual void updateLength();
+    Atom *addChild(const char *name = "");  //new empty child, allocated in the arena of the tree
+    static void destroy(Atom *atom); //instead of delete, for atoms taken out of a tree
+
+    void prune(const char *name);
+    virtual void updateLength();  //of the atoms touched since the last update
+    void touch();                 //the length changed, set by resizes and tree changes
 
-    virtual int64_t contentSize() const { return content.size();   }
-    virtual void    contentResize(size_t newsize); //unused!
+    virtual int64_t contentSize() const { return source ? source_size : int64_t(content.size()); }
+    virtual void    contentResize(size_t newsize);
+    //pointer to size bytes of content, loads it unless the file is mapped
+    const unsigned char *contentData(int64_t offset, int64_t size);
 
     static bool isParent   (const char *id);
     static bool isDual     (const char *id);
     static bool isVersioned(const char *id);
+    static bool isKnown    (const char *id);  //in the atom definitions
 
     virtual int32_t readInt  (int64_t offset);
     virtual int64_t readInt64(int64_t offset);
@@ -69,6 +121,30 @@ public:
     void writeInt64(int64_t value, int64_t offset);
     void readChar(char *str, int64_t offset, int64_t length);
 
+protected:
+    std::vector<unsigned char> content;
+    struct Header {
+        unsigned char data[16];
+    };
+
+    File   *source;       //not NULL while content is still only in the file, after the header
+    int64_t source_size;
+    bool       dirty;     //length needs updating, so do the lengths of the ancestors
+    AtomArena *arena;     //of the tree, owned by its root: the atom not allocated in it
+    bool       pooled;    //allocated in arena
+    int64_t    order;     //increasing in the pre-order of the tree, when indexed
+    int64_t    order_end; //after the last descendant, up to the next atom
+
+    void findByName(const char *name, std::vector<Atom *> &atoms, bool first) const;
+
+    friend class AtomArena;
+
+    void load();
+    virtual void gather(File &file, std::vector<File::Buffer> &buffers, std::deque<Header> &headers);
+    void writeBuffers  (File &file, std::vector<File::Buffer> &buffers);
+    int  encodeHeader(unsigned char *header) const;  //returns its size
+    const unsigned char *peek(int64_t offset, int64_t size, unsigned char *buf);
+
 private:
     // Disable copying (BufferedAtom can't be copied, so children can't either).
     Atom(const Atom&);
@@ -81,12 +157,16 @@ public:
     int64_t file_begin;
     int64_t file_end;
 
-    explicit BufferedAtom(std::string filename);
+    explicit BufferedAtom(std::string filename, int file_flags = 0);
+    explicit BufferedAtom(File *file);  //takes ownership of an open file
     ~BufferedAtom();
 
     virtual void write(File &file);
 
-    unsigned char *getFragment(int64_t offset, int64_t size);
+    //streams can only be read forward, fragments before the current window are lost
+    const unsigned char *getFragment(int64_t offset, int64_t size);
+    int64_t readable(int64_t offset, int64_t size);  //up to size, finds the end of streams
+    int64_t nextData(int64_t offset);                //skips holes in sparse files
     virtual void updateLength();
 
     virtual int64_t contentSize() const { return file_end - file_begin; }
@@ -96,10 +176,16 @@ public:
     virtual int64_t readInt64(int64_t offset);
 
 protected:
-    File            file;
+    File           *file;
     unsigned char  *buffer;
     int64_t         buffer_begin;
     int64_t         buffer_end;
+    int64_t         prefetch_end;
+
+    virtual void gather(File &output, std::vector<File::Buffer> &buffers, std::deque<Header> &headers);
+    bool windowed() const { return file->isDirect() || file->isStream(); }
+    void readAhead(int64_t offset);
+    void readWindow(int64_t offset, int64_t size);
 
 private:
     // Disable copying (File can't be copied).
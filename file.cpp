@@ -23,8 +23,31 @@
 
 #include <vector>
 #include <string>
+#include <fstream>      //for: ExtentFile lists
+#include <sstream>
 #include <cstdio>
+#include <cstdlib>      //for: posix_memalign(), free()
+#include <cstring>      //for: memcpy()
+#include <cerrno>
 #include <cassert>
+#include <algorithm>    //for: min()
+
+#ifdef _WIN32
+# include <io.h>        //for: _setmode(), _chsize_s()
+# include <fcntl.h>     //for: _O_BINARY
+#else
+# include <sys/mman.h>  //for: mmap(), madvise()
+# include <fcntl.h>     //for: open(), posix_fadvise()
+# include <unistd.h>    //for: sysconf(), pread(), pwrite(), ftruncate()
+# include <sys/uio.h>   //for: writev(), pwritev()
+# include <climits>     //for: IOV_MAX
+#endif
+#ifdef __linux__
+# include <sys/ioctl.h>     //for: ioctl()
+# include <sys/sendfile.h>  //for: sendfile()
+# include <sys/syscall.h>   //for: SYS_copy_file_range
+# include <linux/fs.h>      //for: FICLONERANGE
+#endif
 
 using namespace std;
 
@@ -56,31 +79,92 @@ uint64_t swap64(uint64_t ull) {
 #define FILE_SIZE_UPDATE_ON_WRITE   1
 // Seek from end-of-file when seeking to a negative offset.
 //#define FILE_SEEK_FROM_END          1
+// Use pread()/pwrite() for positional I/O (otherwise seek and restore the position).
+#ifndef _WIN32
+# define FILE_USE_PREAD             1
+#endif
+// Map files opened for reading into memory (falls back to stdio on failure).
+#ifndef _WIN32
+# define FILE_USE_MMAP              1
+#endif
+// Size and alignment of the blocks written to files opened for writing.
+#define FILE_WRITE_BUFFER_SIZE      (4 << 20)
+// Size of the aligned buffer for unaligned reads of files opened with DirectIO.
+#define FILE_DIRECT_BUFFER_SIZE     (1 << 20)
+// Readable zero bytes after the end of a mapping, so decoders can overread
+//  the end of the last sample (like AV_INPUT_BUFFER_PADDING_SIZE).
+#define FILE_MAP_PADDING            64
 
 
 // Encapsulate FILE (RAII).
-File::File() : file(NULL), file_sz(-1) { }
+File::File()
+	: file(NULL), file_sz(-1),
+	  stream(false), read_pos(0),
+	  map_data(NULL), map_size(0),
+	  direct_fd(-1), direct_buf(NULL),
+	  write_buf(NULL), write_len(0), write_pos(0)
+{ }
 
 File::~File() {
 	close();
 }
 
 
-bool File::open(string filename) {
+bool File::open(string filename, int flags) {
 	close();
 
 	if(filename.empty())
 		return false;
-	file = fopen(filename.c_str(), "rb");
+	if(filename == "-") {
+#ifdef _WIN32
+		_setmode(_fileno(stdin), _O_BINARY);
+#endif
+		// Use a duplicate, so closing this File doesn't close stdin.
+		int fd = dup(fileno(stdin));
+		file = (fd >= 0) ? fdopen(fd, "rb") : NULL;
+	} else {
+		file = fopen(filename.c_str(), "rb");
+	}
 	if(!file)
 		return false;
 
-	fseeko(file, 0L, SEEK_END);
-	off_t sz = ftello(file);
-	fseeko(file, 0L, SEEK_SET);
-	if(sz < 0)
-		return false;
+	off_t sz = -1;
+	if(fseeko(file, 0L, SEEK_END) == 0) {
+		sz = ftello(file);
+		fseeko(file, 0L, SEEK_SET);
+	}
+	if(sz < 0) {
+		// A pipe or terminal: size unknown until the end is reached.
+		stream   = true;
+		read_pos = 0;
+		return true;
+	}
 	file_sz = sz;
+
+	// Optional: use stdio for small reads and readAt() for bulk data.
+	if(flags & DirectIO) {
+#if defined(O_DIRECT)
+		direct_fd = ::open(filename.c_str(), O_RDONLY | O_DIRECT);
+#elif defined(F_NOCACHE)
+		direct_fd = ::open(filename.c_str(), O_RDONLY);
+		if(direct_fd >= 0 && fcntl(direct_fd, F_NOCACHE, 1) != 0) {
+			::close(direct_fd);
+			direct_fd = -1;
+		}
+#endif
+#ifdef FILE_USE_PREAD
+		void *buf = NULL;
+		if(direct_fd >= 0 && posix_memalign(&buf, DirectAlignment, FILE_DIRECT_BUFFER_SIZE) == 0) {
+			direct_buf = static_cast<char*>(buf);
+		} else if(direct_fd >= 0) {
+			::close(direct_fd);
+			direct_fd = -1;
+		}
+#endif
+		return true;
+	}
+
+	mapFile();  // Optional: use stdio if the file can't be mapped.
 	return true;
 }
 
@@ -89,9 +173,25 @@ bool File::create(string filename) {
 
 	if(filename.empty())
 		return false;
-	file = fopen(filename.c_str(), "wb");
+	if(filename == "-") {
+#ifdef _WIN32
+		_setmode(_fileno(stdout), _O_BINARY);
+#endif
+		fflush(stdout);
+		int fd = dup(fileno(stdout));
+		file = (fd >= 0) ? fdopen(fd, "wb") : NULL;
+	} else {
+		file = fopen(filename.c_str(), "wb");
+	}
 	if(!file)
 		return false;
+	// Writes are collected in our own, larger, buffer (set before any other use of file).
+	setvbuf(file, NULL, _IONBF, 0);
+	// A pipe or socket: written forward only, writeAt() fails.
+	stream = (ftello(file) < 0);
+	write_buf = new unsigned char[FILE_WRITE_BUFFER_SIZE];
+	write_len = 0;
+	write_pos = 0;
 
 #ifdef FILE_SIZE_UPDATE_ON_WRITE
 	file_sz = 0;
@@ -99,32 +199,216 @@ bool File::create(string filename) {
 	return true;
 }
 
+bool File::modify(string filename) {
+	close();
+
+	if(filename.empty())
+		return false;
+	file = fopen(filename.c_str(), "r+b");
+	if(!file)
+		return false;
+	setvbuf(file, NULL, _IONBF, 0);
+	off_t sz = -1;
+	if(fseeko(file, 0L, SEEK_END) == 0)
+		sz = ftello(file);
+	if(sz < 0) {
+		close();
+		return false;
+	}
+	write_buf = new unsigned char[FILE_WRITE_BUFFER_SIZE];
+	write_len = 0;
+	write_pos = sz;
+	file_sz   = sz;
+	return true;
+}
+
 void File::close() {
+	unmapFile();
+#ifndef _WIN32
+	if(direct_fd >= 0)
+		::close(direct_fd);
+#endif
+	direct_fd = -1;
+	free(direct_buf);
+	direct_buf = NULL;
 	if(file) {
+		if(write_buf)
+			flush();
 		FILE *rm_file = file;
 		file = NULL;
 		fclose(rm_file);
 	}
+	delete[] write_buf;
+	write_buf = NULL;
+	stream    = false;
+	read_pos  = 0;
+	write_len = 0;
+	write_pos = 0;
 	file_sz = -1;
 }
 
 
+bool File::mapFile() {
+#ifdef FILE_USE_MMAP
+	unmapFile();
+	if(!file || file_sz <= 0)
+		return false;
+
+	long page = sysconf(_SC_PAGESIZE);
+	if(page <= 0)
+		page = 4096;
+	// The file might not fit in the address space (i.e. on 32-bit systems).
+	if(uint64_t(file_sz) > uint64_t(size_t(-1)) - FILE_MAP_PADDING - page)
+		return false;
+	size_t len   = size_t(file_sz);
+	size_t total = (len + FILE_MAP_PADDING + page - 1) / page * page;
+
+	// Reserve zeroed memory for the file plus padding, then map the file over it.
+	void *base = mmap(NULL, total, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(base == MAP_FAILED)
+		return false;
+	void *data = mmap(base, len, PROT_READ, MAP_PRIVATE | MAP_FIXED, fileno(file), 0);
+	if(data == MAP_FAILED) {
+		munmap(base, total);
+		return false;
+	}
+	map_data = static_cast<unsigned char*>(data);
+	map_size = total;
+	read_pos  = 0;
+	return true;
+#else
+	return false;
+#endif
+}
+
+void File::unmapFile() {
+#ifdef FILE_USE_MMAP
+	if(map_data)
+		munmap(map_data, map_size);
+#endif
+	map_data = NULL;
+	map_size = 0;
+	read_pos  = 0;
+}
+
+const unsigned char *File::map(off_t offset, size_t n) const {
+	if(!map_data || offset < 0 || uint64_t(offset) + n > uint64_t(file_sz))
+		return NULL;
+	return map_data + offset;
+}
+
+void File::prefetch(off_t offset, off_t n) {
+	// Direct I/O does its own read-ahead.
+	if(!file || direct_fd >= 0 || offset < 0 || n <= 0 || offset >= file_sz)
+		return;
+	if(n > file_sz - offset)
+		n = file_sz - offset;
+#ifdef FILE_USE_MMAP
+	if(map_data) {
+		// madvise() needs a page aligned address.
+		long page = sysconf(_SC_PAGESIZE);
+		if(page <= 0)
+			page = 4096;
+		off_t begin = offset / page * page;
+		madvise(map_data + begin, size_t(n + (offset - begin)), MADV_WILLNEED);
+		return;
+	}
+#endif
+#ifdef POSIX_FADV_WILLNEED
+	posix_fadvise(fileno(file), offset, n, POSIX_FADV_WILLNEED);
+#endif
+}
+
+off_t File::nextData(off_t offset) {
+#ifdef SEEK_DATA
+	if(!file || stream || offset < 0 || offset >= file_sz)
+		return offset;
+	// Restore the descriptor position, stdio still reads from it.
+	int   fd   = (direct_fd >= 0) ? direct_fd : fileno(file);
+	off_t cur  = lseek(fd, 0, SEEK_CUR);
+	off_t data = lseek(fd, offset, SEEK_DATA);
+	if(data < 0 && errno == ENXIO)
+		data = file_sz;
+	if(cur >= 0)
+		lseek(fd, cur, SEEK_SET);
+	if(data < offset)
+		return offset;
+	return min(data, file_sz);
+#else
+	return offset;
+#endif
+}
+
+// Read n bytes from the mapping at the current position.
+const unsigned char *File::mapRead(size_t n) {
+	const unsigned char *p = map(read_pos, n);
+	if(p)
+		read_pos += n;
+	return p;
+}
+
+
 off_t File::pos() {
+	if(map_data)
+		return read_pos;
+	if(write_buf)
+		return write_pos + write_len;
+	if(stream)
+		return read_pos;
 	return (file) ? ftello(file) : off_t(-1);
 }
 
 void File::seek(off_t offset) {
 #ifdef FILE_SEEK_FROM_END
+	if(map_data) {
+		read_pos = (offset >= 0) ? offset : file_sz + offset;
+		return;
+	}
+	if(stream) {
+		if(!write_buf)
+			skip(offset);
+		return;
+	}
+	if(write_buf) {
+		flush();
+		if(fseeko(file, offset, (offset >= 0) ? SEEK_SET : SEEK_END) == 0)
+			write_pos = ftello(file);
+		return;
+	}
 	if(file)
 		fseeko(file, offset, (offset >= 0) ? SEEK_SET : SEEK_END);
 #else
 	assert(offset >= 0);
+	if(map_data) {
+		if(offset >= 0)
+			read_pos = offset;
+		return;
+	}
+	if(stream) {
+		if(!write_buf)
+			skip(offset);
+		return;
+	}
+	if(write_buf && offset >= 0) {
+		flush();
+		if(fseeko(file, offset, SEEK_SET) == 0)
+			write_pos = offset;
+		return;
+	}
 	if(file && offset >= 0)
 		fseeko(file, offset, SEEK_SET);
 #endif
 }
 
 void File::rewind() {
+	if(map_data) {
+		read_pos = 0;
+		return;
+	}
+	if(write_buf) {
+		seek(0);
+		return;
+	}
 	if(file) {
 		fseeko(file, 0L, SEEK_SET);
 		clearerr(file);
@@ -134,7 +418,9 @@ void File::rewind() {
 bool File::atEnd() {
 	if(!file)
 		return true;
-	off_t pos = ftello(file);
+	if(stream)
+		return feof(file) != 0;
+	off_t pos = this->pos();
 	if(pos < 0)
 		return true;
 	off_t sz  = file_sz;
@@ -171,9 +457,15 @@ off_t File::size() {
 
 int32_t File::readInt() {
 	uint32_t value = 0;
-	size_t n = (file) ? fread(&value, sizeof(value), 1, file) : 0;
-	if(n != 1)
-		throw string("Could not read atom length");
+	if(map_data) {
+		const unsigned char *p = mapRead(sizeof(value));
+		if(!p)
+			throw string("Could not read atom length");
+		memcpy(&value, p, sizeof(value));
+	} else {
+		if(readData(&value, sizeof(value)) != sizeof(value))
+			throw string("Could not read atom length");
+	}
 
 	// Read a 32-bit big-endian value.
 	// A compiler will optimize this to a single instruction if possible.
@@ -183,9 +475,15 @@ int32_t File::readInt() {
 
 int64_t File::readInt64() {
 	uint64_t value = 0;
-	size_t n = (file) ? fread(&value, sizeof(value), 1, file) : 0;
-	if(n != 1)
-		throw string("Could not read atom length");
+	if(map_data) {
+		const unsigned char *p = mapRead(sizeof(value));
+		if(!p)
+			throw string("Could not read atom length");
+		memcpy(&value, p, sizeof(value));
+	} else {
+		if(readData(&value, sizeof(value)) != sizeof(value))
+			throw string("Could not read atom length");
+	}
 
 	// Read a 64-bit big-endian value.
 	// A compiler will optimize this to a single instruction if possible.
@@ -197,23 +495,175 @@ int64_t File::readInt64() {
 void File::readChar(char *dest, size_t n) {
 	assert(dest != NULL || n == 0);
 	if(n > 0) {
-		size_t len = fread(dest, sizeof(char), n, file);
-		if(len != n)
+		if(map_data) {
+			const unsigned char *p = mapRead(n);
+			if(!p)
+				throw string("Could not read chars");
+			memcpy(dest, p, n);
+			return;
+		}
+		if(readData(dest, n) != n)
 			throw string("Could not read chars");
 	}
 }
 
 vector<unsigned char> File::read(size_t n) {
+	if(map_data) {
+		const unsigned char *p = mapRead(n);
+		if(!p)
+			throw string("Could not read at position");
+		return vector<unsigned char>(p, p + n);
+	}
 	vector<unsigned char> dest(n);
 	if(n > 0) {
-		size_t len = fread(&dest[0], sizeof(unsigned char), n, file);
-		if(len != n)
+		if(readData(&dest[0], n) != n)
 			throw string("Could not read at position");
 	}
 	return dest;
 }
 
 
+ssize_t File::readAt(off_t offset, void *dest, size_t n) {
+	assert(dest != NULL || n == 0);
+	if(!file || offset < 0)
+		return -1;
+	if(stream) {
+		if(write_buf || offset < read_pos)
+			return -1;
+		skip(offset);
+		if(read_pos != offset)
+			return 0;
+		return readData(dest, n);
+	}
+	if(offset >= file_sz || n == 0)
+		return 0;
+	if(direct_fd >= 0)
+		return directReadAt(offset, dest, n);  // Stops at end-of-file.
+	if(uint64_t(n) > uint64_t(file_sz - offset))
+		n = size_t(file_sz - offset);
+
+	if(map_data) {
+		memcpy(dest, map_data + offset, n);
+		return n;
+	}
+#ifdef FILE_USE_PREAD
+	int     fd   = fileno(file);
+	char   *p    = static_cast<char*>(dest);
+	size_t  done = 0;
+	while(done < n) {
+		ssize_t len = pread(fd, p + done, n - done, offset + done);
+		if(len < 0 && errno == EINTR)
+			continue;
+		if(len <= 0)
+			break;
+		done += len;
+	}
+	return (done > 0 || n == 0) ? ssize_t(done) : -1;
+#else
+	off_t pos = ftello(file);
+	if(pos < 0 || fseeko(file, offset, SEEK_SET) != 0)
+		return -1;
+	size_t len = fread(dest, sizeof(char), n, file);
+	fseeko(file, pos, SEEK_SET);
+	return len;
+#endif
+}
+
+// Read from the stdio file at its current position.
+size_t File::readData(void *dest, size_t n) {
+	size_t len = (file) ? fread(dest, sizeof(char), n, file) : 0;
+	if(stream)
+		read_pos += len;
+	return len;
+}
+
+// Move a stream forward to offset, by reading and discarding its data.
+void File::skip(off_t offset) {
+	char buff[1 << 16];
+	while(stream && read_pos < offset) {
+		size_t len = size_t(min(offset - read_pos, off_t(sizeof(buff))));
+		if(readData(buff, len) != len)
+			break;
+	}
+}
+
+// Read with the direct I/O descriptor.
+// Aligned requests are read straight into dest, others through direct_buf.
+ssize_t File::directReadAt(off_t offset, void *dest, size_t n) const {
+#ifdef FILE_USE_PREAD
+	const size_t align = DirectAlignment;
+	char  *p    = static_cast<char*>(dest);
+	size_t done = 0;
+
+	if(offset % align == 0 && n % align == 0 && reinterpret_cast<uintptr_t>(p) % align == 0) {
+		while(done < n) {
+			ssize_t len = pread(direct_fd, p + done, n - done, offset + done);
+			if(len < 0 && errno == EINTR)
+				continue;
+			if(len <= 0)
+				break;
+			done += len;
+		}
+		return (done > 0) ? ssize_t(done) : -1;
+	}
+
+	const size_t chunk = FILE_DIRECT_BUFFER_SIZE;
+	while(done < n) {
+		off_t   pos   = offset + done;
+		off_t   begin = pos / align * align;
+		size_t  skip  = size_t(pos - begin);
+		ssize_t len   = pread(direct_fd, direct_buf, min(chunk, (skip + n - done + align - 1) / align * align), begin);
+		if(len < 0 && errno == EINTR)
+			continue;
+		if(len <= ssize_t(skip))
+			break;
+		size_t used = min(size_t(len) - skip, n - done);
+		memcpy(p + done, direct_buf + skip, used);
+		done += used;
+	}
+	return (done > 0) ? ssize_t(done) : -1;
+#else
+	return -1;
+#endif
+}
+
+ssize_t File::writeAt(off_t offset, const void *source, size_t n) {
+	assert(source != NULL || n == 0);
+	if(!file || !write_buf || offset < 0)
+		return -1;
+	if(n == 0)
+		return 0;
+	if(!flush())
+		return -1;
+
+#ifdef FILE_USE_PREAD
+	int         fd   = fileno(file);
+	const char *p    = static_cast<const char*>(source);
+	size_t      done = 0;
+	while(done < n) {
+		ssize_t len = pwrite(fd, p + done, n - done, offset + done);
+		if(len < 0 && errno == EINTR)
+			continue;
+		if(len <= 0)
+			return -1;
+		done += len;
+	}
+#else
+	if(fseeko(file, offset, SEEK_SET) != 0)
+		return -1;
+	size_t done = fwrite(source, sizeof(char), n, file);
+	fseeko(file, write_pos, SEEK_SET);
+	if(done != n)
+		return -1;
+#endif
+#ifdef FILE_SIZE_UPDATE_ON_WRITE
+	if(file_sz < offset + off_t(n))
+		file_sz = offset + n;
+#endif
+	return n;
+}
+
+
 ssize_t File::writeInt(int32_t value) {
 	if(!file)
 		return -1;
@@ -228,15 +678,9 @@ ssize_t File::writeInt(int32_t value) {
 		static_cast<uint8_t>(val32)
 	};
 
-	size_t len = fwrite(&data, sizeof(data), 1, file);
-	if(len == 0)
-		return (ferror(file)) ? -1 : 0;
-#ifdef FILE_SIZE_UPDATE_ON_WRITE
-	off_t  pos = ftello(file);
-	if(file_sz < pos)
-		file_sz = pos;
-#endif
-	return len;
+	if(!writeData(data, sizeof(data)))
+		return -1;
+	return 1;
 }
 
 ssize_t File::writeInt64(int64_t value) {
@@ -257,15 +701,9 @@ ssize_t File::writeInt64(int64_t value) {
 		static_cast<uint8_t>(val64)
 	};
 
-	size_t len = fwrite(&data, sizeof(data), 1, file);
-	if(len == 0)
-		return (ferror(file)) ? -1 : 0;
-#ifdef FILE_SIZE_UPDATE_ON_WRITE
-	off_t  pos = ftello(file);
-	if(file_sz < pos)
-		file_sz = pos;
-#endif
-	return len;
+	if(!writeData(data, sizeof(data)))
+		return -1;
+	return 1;
 }
 
 ssize_t File::writeChar(const char *source, size_t n) {
@@ -275,15 +713,9 @@ ssize_t File::writeChar(const char *source, size_t n) {
 	if(!file)
 		return -1;
 
-	size_t len = fwrite(source, sizeof(char), n, file);
-	if(len == 0)
-		return (ferror(file)) ? -1 : 0;
-#ifdef FILE_SIZE_UPDATE_ON_WRITE
-	off_t  pos = ftello(file);
-	if(file_sz < pos)
-		file_sz = pos;
-#endif
-	return len;
+	if(!writeData(source, n))
+		return -1;
+	return n;
 }
 
 ssize_t File::write(vector<unsigned char> &v) {
@@ -292,14 +724,359 @@ ssize_t File::write(vector<unsigned char> &v) {
 	if(!file)
 		return -1;
 
-	size_t len = fwrite(&v[0], sizeof(unsigned char), v.size(), file);
-	if(len == 0)
-		return (ferror(file)) ? -1 : 0;
+	if(!writeData(&v[0], v.size()))
+		return -1;
+	return v.size();
+}
+
+ssize_t File::writeGather(const vector<Buffer> &buffers) {
+	if(!file || !flush())
+		return -1;
+
+	ssize_t done = 0;
+#ifdef _WIN32
+	for(unsigned int i = 0; i < buffers.size(); ++i) {
+		if(!writeData(buffers[i].data, buffers[i].size))
+			return -1;
+		done += buffers[i].size;
+	}
+#else
+# ifndef IOV_MAX
+#  define IOV_MAX 1024
+# endif
+	vector<struct iovec> iov(buffers.size());
+	for(unsigned int i = 0; i < buffers.size(); ++i) {
+		iov[i].iov_base = const_cast<void*>(buffers[i].data);
+		iov[i].iov_len  = buffers[i].size;
+	}
+	int    fd = fileno(file);
+	size_t i  = 0;
+	while(true) {
+		while(i < iov.size() && iov[i].iov_len == 0)
+			++i;
+		if(i == iov.size())
+			break;
+		int     count = int(min(iov.size() - i, size_t(IOV_MAX)));
+		ssize_t len;
+		if(stream)
+			len = ::writev(fd, &iov[i], count);
+		else {
+# ifdef __linux__
+			len = pwritev(fd, &iov[i], count, write_pos);
+# else
+			len = (lseek(fd, write_pos, SEEK_SET) == write_pos) ? ::writev(fd, &iov[i], count) : -1;
+# endif
+		}
+		if(len < 0 && errno == EINTR)
+			continue;
+		if(len <= 0)
+			return -1;
+		write_pos += len;
+		done      += len;
+		// Skip what was written, a partial write continues inside a buffer.
+		while(i < iov.size() && size_t(len) >= iov[i].iov_len) {
+			len -= iov[i].iov_len;
+			++i;
+		}
+		if(len > 0) {
+			iov[i].iov_base = static_cast<char*>(iov[i].iov_base) + len;
+			iov[i].iov_len -= len;
+		}
+	}
+	// Re-synchronize stdio.
+	if(!stream && fseeko(file, write_pos, SEEK_SET) != 0)
+		return -1;
+#endif
+
 #ifdef FILE_SIZE_UPDATE_ON_WRITE
-	off_t  pos = ftello(file);
-	if(file_sz < pos)
-		file_sz = pos;
+	if(file_sz < pos())
+		file_sz = pos();
 #endif
-	return len;
+	return done;
 }
 
+bool File::flush() {
+	if(!file || !write_buf)
+		return false;
+	if(write_len > 0) {
+		size_t len = fwrite(write_buf, sizeof(unsigned char), write_len, file);
+		if(len != write_len)
+			return false;
+		write_pos += write_len;
+		write_len  = 0;
+	}
+	return true;
+}
+
+bool File::truncate(off_t size) {
+	if(!file || size < 0)
+		return false;
+	if(write_buf && !flush())
+		return false;
+#ifdef _WIN32
+	if(_chsize_s(_fileno(file), size) != 0)
+		return false;
+#else
+	if(ftruncate(fileno(file), size) != 0)
+		return false;
+#endif
+	file_sz = size;
+	if(pos() > size)
+		seek(size);
+	return true;
+}
+
+// Append to the write buffer.
+// The buffer is flushed when it reaches the next multiple of FILE_WRITE_BUFFER_SIZE
+//  in the file, so all full flushes are large and aligned.
+bool File::writeData(const void *source, size_t n) {
+	if(!file || !write_buf)
+		return false;
+
+	const unsigned char *p = static_cast<const unsigned char*>(source);
+	while(n > 0) {
+		// Room up to the next aligned block boundary.
+		size_t room = FILE_WRITE_BUFFER_SIZE - size_t(write_pos % FILE_WRITE_BUFFER_SIZE);
+		if(write_len == 0 && n >= room) {
+			// Write whole blocks directly, bypassing the buffer.
+			size_t len = n - (n - room) % FILE_WRITE_BUFFER_SIZE;
+			if(fwrite(p, sizeof(unsigned char), len, file) != len)
+				return false;
+			write_pos += len;
+			p += len;
+			n -= len;
+			continue;
+		}
+		size_t len = min(n, room - write_len);
+		memcpy(write_buf + write_len, p, len);
+		write_len += len;
+		p += len;
+		n -= len;
+		if(write_len == room && !flush())
+			return false;
+	}
+#ifdef FILE_SIZE_UPDATE_ON_WRITE
+	if(file_sz < write_pos + off_t(write_len))
+		file_sz = write_pos + write_len;
+#endif
+	return true;
+}
+
+off_t File::copy(File &source, off_t offset, off_t n) {
+	if(!file || offset < 0 || n < 0)
+		return -1;
+	if(n == 0)
+		return 0;
+	if(!flush())
+		return -1;
+	off_t dst = write_pos;
+
+	off_t done = 0;
+#ifdef __linux__
+	// Let the kernel move the data, in chunks that fit in a ssize_t.
+	const off_t chunk = 1 << 30;
+	int in  = source.file ? fileno(source.file) : -1;  // Not for an ExtentFile.
+	int out = fileno(file);
+# ifdef FICLONERANGE
+	// Share the blocks (reflink) on file systems that support it (btrfs, XFS).
+	// Fails unless both offsets are block aligned.
+	struct file_clone_range range;
+	range.src_fd      = in;
+	range.src_offset  = offset;
+	range.src_length  = n;
+	range.dest_offset = dst;
+	if(in >= 0 && !source.isStream() && ioctl(out, FICLONERANGE, &range) == 0)
+		done = n;
+# endif
+	// Kernel copies go through the page cache, read direct sources ourselves instead.
+	// Streams are read forward through stdio.
+	if(in >= 0 && !source.isDirect() && !source.isStream()) {
+# ifdef SYS_copy_file_range
+		while(done < n) {
+			loff_t  off_in  = offset + done;
+			loff_t  off_out = dst + done;
+			ssize_t len = syscall(SYS_copy_file_range, in, &off_in, out, &off_out,
+			                      size_t(min(n - done, chunk)), 0u);
+			if(len <= 0)
+				break;
+			done += len;
+		}
+# endif
+		// sendfile() writes at the current position of the output descriptor.
+		if(done < n && lseek(out, dst + done, SEEK_SET) == dst + done) {
+			while(done < n) {
+				off_t   off_in = offset + done;
+				ssize_t len    = sendfile(out, in, &off_in, size_t(min(n - done, chunk)));
+				if(len <= 0)
+					break;
+				done += len;
+			}
+		}
+	}
+	if(done > 0) {  // Re-synchronize stdio (pipes fail all of the above).
+		if(fseeko(file, dst + done, SEEK_SET) != 0)
+			return -1;
+		write_pos = dst + done;
+	}
+#endif
+
+	// Copy through userspace, straight from the mapping if possible.
+	if(done < n) {
+		const off_t chunk = 1 << 20;
+		vector<char> buff;
+		if(!source.map_data)
+			buff.resize(chunk);
+		while(done < n) {
+			size_t toread = size_t(min(n - done, chunk));
+			const char *p = reinterpret_cast<const char*>(source.map(offset + done, toread));
+			if(!p) {
+				if(buff.empty() || source.readAt(offset + done, &buff[0], toread) != ssize_t(toread))
+					break;
+				p = &buff[0];
+			}
+			if(!writeData(p, toread))
+				break;
+			done += toread;
+		}
+	}
+
+#ifdef FILE_SIZE_UPDATE_ON_WRITE
+	if(file_sz < pos())
+		file_sz = pos();
+#endif
+	return done;
+}
+
+
+
+// ExtentFile
+ExtentFile::ExtentFile() { }
+
+ExtentFile::~ExtentFile() {
+	clear();
+}
+
+void ExtentFile::clear() {
+	for(unsigned int i = 0; i < files.size(); ++i)
+		delete files[i].second;
+	files.clear();
+	extents.clear();
+	file_sz = -1;
+}
+
+bool ExtentFile::open(string list_filename, int flags) {
+	clear();
+	ifstream list(list_filename.c_str());
+	if(!list)
+		return false;
+
+	flags &= ~ExtentList;
+	file_sz = 0;
+	string line;
+	while(getline(list, line)) {
+		istringstream fields(line);
+		off_t  offset = -1, length = -1;
+		string path;
+		if(!(fields >> offset))
+			continue;  // Empty line or comment.
+		fields >> length >> ws;
+		getline(fields, path);
+		if(!add(path, offset, length, flags)) {
+			clear();
+			return false;
+		}
+	}
+	return !extents.empty();
+}
+
+bool ExtentFile::add(string filename, off_t offset, off_t length, int flags) {
+	if(filename.empty() || offset < 0 || length <= 0)
+		return false;
+
+	File *file = NULL;
+	for(unsigned int i = 0; i < files.size() && !file; ++i) {
+		if(files[i].first == filename)
+			file = files[i].second;
+	}
+	if(!file) {
+		file = new File;
+		if(!file->open(filename, flags) || file->isStream()) {
+			delete file;
+			return false;
+		}
+		files.push_back(make_pair(filename, file));
+	}
+	if(offset + length > file->size())
+		return false;
+
+	Extent extent;
+	extent.file   = file;
+	extent.offset = offset;
+	extent.begin  = max(file_sz, off_t(0));
+	extent.length = length;
+	extents.push_back(extent);
+	file_sz = extent.begin + length;
+	return true;
+}
+
+// The extent containing offset, or NULL.
+const ExtentFile::Extent *ExtentFile::find(off_t offset) const {
+	if(offset < 0 || offset >= file_sz)
+		return NULL;
+	// Binary search the last extent beginning at or before offset.
+	size_t lo = 0, hi = extents.size();
+	while(hi - lo > 1) {
+		size_t mid = (lo + hi) / 2;
+		if(extents[mid].begin <= offset)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return &extents[lo];
+}
+
+ssize_t ExtentFile::readAt(off_t offset, void *dest, size_t n) {
+	char  *p    = static_cast<char*>(dest);
+	size_t done = 0;
+	while(done < n) {
+		const Extent *e = find(offset + done);
+		if(!e)
+			break;
+		off_t   skip = offset + done - e->begin;
+		size_t  len  = size_t(min(off_t(n - done), e->length - skip));
+		ssize_t got  = e->file->readAt(e->offset + skip, p + done, len);
+		if(got <= 0)
+			return (done > 0) ? ssize_t(done) : got;
+		done += got;
+	}
+	return done;
+}
+
+const unsigned char *ExtentFile::map(off_t offset, size_t n) const {
+	const Extent *e = find(offset);
+	if(!e || uint64_t(offset - e->begin) + n > uint64_t(e->length))
+		return NULL;
+	return e->file->map(e->offset + (offset - e->begin), n);
+}
+
+void ExtentFile::prefetch(off_t offset, off_t n) {
+	while(n > 0) {
+		const Extent *e = find(offset);
+		if(!e)
+			return;
+		off_t skip = offset - e->begin;
+		off_t len  = min(n, e->length - skip);
+		e->file->prefetch(e->offset + skip, len);
+		offset += len;
+		n      -= len;
+	}
+}
+
+off_t ExtentFile::nextData(off_t offset) {
+	const Extent *e = find(offset);
+	if(!e)
+		return offset;
+	// Holes are looked for within this extent only.
+	off_t data = e->file->nextData(e->offset + (offset - e->begin)) - e->offset + e->begin;
+	return min(max(data, offset), e->begin + e->length);
+}
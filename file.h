@@ -40,10 +40,22 @@ uint64_t swap64(uint64_t ull);
 class File {
 public:
 	File();
-	~File();
-
-	bool open  (std::string filename);
+	virtual ~File();
+
+	// Open flags.
+	enum {
+		DirectIO   = 1, // Read bypassing the OS page cache, if supported.
+		ExtentList = 2  // Open a list of extents as one file (see ExtentFile).
+	};
+	// Alignment of offsets, sizes and buffers for direct I/O.
+	static const size_t DirectAlignment = 4096;
+
+	// Open a file for reading; "-" opens the standard input.
+	// Files that can't seek (pipes) are opened as streams, which can only be read forward.
+	virtual bool open(std::string filename, int flags = 0);
 	bool create(std::string filename);
+	// Open an existing file for reading and writing; writes start at its end.
+	bool modify(std::string filename);
 
 	operator bool() { return static_cast<bool>(file); }
 
@@ -59,16 +71,69 @@ public:
 	void    readChar(char *dest, size_t n);
 	std::vector<unsigned char> read(size_t n);
 
+	// Read or write at offset, without using or moving the current position.
+	// readAt() may be called concurrently from several threads,
+	//  except on streams, where it reads forward from the current position,
+	//  and on files opened with DirectIO, which share one bounce buffer.
+	// writeAt() first flushes the buffered writes.
+	virtual ssize_t readAt(off_t offset, void *dest, size_t n);
+	ssize_t writeAt(off_t offset, const void *source, size_t n);
+
+	// Direct access to a file opened for reading and mapped into memory.
+	// Returns NULL if the file is not mapped or the range is out of bounds.
+	bool isMapped() const { return map_data != NULL; }
+	bool isDirect() const { return direct_fd >= 0; }
+	bool isStream() const { return stream; }
+	virtual const unsigned char *map(off_t offset, size_t n) const;
+
+	// Ask the OS to start reading a range in the background (a hint only).
+	virtual void prefetch(off_t offset, off_t n);
+	// Start of the data at or after offset, skipping holes in sparse files.
+	// Returns offset if holes can't be detected, the size if only a hole follows.
+	virtual off_t nextData(off_t offset);
+
 	ssize_t writeInt  (int32_t value);
 	ssize_t writeInt64(int64_t value);
 	ssize_t writeChar (const char *source, size_t n);
 	ssize_t write(std::vector<unsigned char> &v);
+	// A piece of a gathered write.
+	struct Buffer {
+		const void *data;
+		size_t      size;
+	};
+	// Write the buffers in order, with one system call for many of them (writev).
+	ssize_t writeGather(const std::vector<Buffer> &buffers);
+	bool    flush();
+	bool    truncate(off_t size);  // Writing continues at size, if it was beyond.
+	// Write n bytes from source starting at offset, without going through
+	//  userspace if the OS supports it. Returns the number of bytes written.
+	off_t   copy(File &source, off_t offset, off_t n);
 
 protected:
 	std::FILE *file;
 	off_t file_sz;
 
+	bool           stream;    // Not seekable: read forward only.
+	off_t          read_pos;  // Of mapped files and streams.
+
+	unsigned char *map_data;
+	size_t         map_size;  // Including padding.
+
+	int            direct_fd;
+	char          *direct_buf;  // Aligned, for unaligned direct reads.
+
+	unsigned char *write_buf;
+	size_t         write_len;
+	off_t          write_pos;  // File position of write_buf.
+
 	void close();
+	bool mapFile();
+	void unmapFile();
+	const unsigned char *mapRead(size_t n);
+	size_t readData(void *dest, size_t n);
+	void   skip(off_t offset);
+	bool writeData(const void *source, size_t n);
+	ssize_t directReadAt(off_t offset, void *dest, size_t n) const;
 
 private:
 	// Disable copying.
@@ -76,4 +141,35 @@ private:
 	File& operator=(const File&);
 };
 
+
+// Read only file made of extents of other files, i.e. the fragments of a
+//  video found by a recovery tool, or byte ranges in a disk image.
+// The list has a line per extent: <offset> <length> <path>, in file order.
+class ExtentFile : public File {
+public:
+	ExtentFile();
+	~ExtentFile();
+
+	virtual bool open(std::string list_filename, int flags = 0);
+	bool add(std::string filename, off_t offset, off_t length, int flags = 0);
+
+	virtual ssize_t readAt(off_t offset, void *dest, size_t n);
+	virtual const unsigned char *map(off_t offset, size_t n) const;  // Within one extent.
+	virtual void  prefetch(off_t offset, off_t n);
+	virtual off_t nextData(off_t offset);
+
+protected:
+	struct Extent {
+		File *file;
+		off_t offset;   // In file.
+		off_t begin;    // In this file.
+		off_t length;
+	};
+	std::vector<Extent> extents;
+	std::vector<std::pair<std::string, File *> > files;  // Opened once per path.
+
+	void clear();
+	const Extent *find(off_t offset) const;
+};
+
 #endif // FILE_H
@@ -0,0 +1,180 @@
+//==================================================================//
+/*
+	Untrunc - index.cpp
+
+	Untrunc is GPL software; you can freely distribute,
+	redistribute, modify & use under the terms of the GNU General
+	Public License; either version 2 or its successor.
+
+	Untrunc is distributed under the GPL "AS IS", without
+	any warranty; without the implied warranty of merchantability
+	or fitness for either an expressed or implied particular purpose.
+
+	Please see the included GNU General Public License (GPL) for
+	your rights and further details; see the file COPYING. If you
+	cannot, write to the Free Software Foundation, 59 Temple Place
+	Suite 330, Boston, MA 02111-1307, USA.  Or www.fsf.org
+
+	Copyright 2010 Federico Ponchio
+                                                                    */
+//==================================================================//
+
+#include "index.h"
+
+#include <vector>
+#include <string>
+#include <iostream>
+#include <algorithm>    //for: equal()
+extern "C" {
+#include <sys/stat.h>   //for: stat()
+}
+
+using namespace std;
+
+
+// Flush the index every so many records, so a killed repair loses little.
+#define INDEX_FLUSH_RECORDS     1024
+
+
+// File layout, all numbers are unsigned LEB128 varints:
+//  header:  "UTIX", version, mdat begin, file size, file mtime,
+//           number of tracks, per track: name length, name.
+//  sample:  1 + (track << 1 | keyframe), offset - end of the previous sample, size, duration.
+//  end:     0, scan end - end of the last sample.
+// A partial record at the end (from a killed repair) is dropped.
+namespace {
+	const unsigned char Magic[4]  = { 'U', 'T', 'I', 'X' };
+	const unsigned int  Version   = 2;
+
+	void putVarint(vector<unsigned char> &buf, uint64_t value) {
+		while(value >= 0x80) {
+			buf.push_back(static_cast<unsigned char>(value | 0x80));
+			value >>= 7;
+		}
+		buf.push_back(static_cast<unsigned char>(value));
+	}
+
+	// Returns false if the varint is cut off by the end of the buffer.
+	bool getVarint(const vector<unsigned char> &buf, size_t &pos, uint64_t &value) {
+		value = 0;
+		for(unsigned int shift = 0; pos < buf.size() && shift < 64; shift += 7) {
+			unsigned char c = buf[pos++];
+			value |= uint64_t(c & 0x7F) << shift;
+			if(!(c & 0x80))
+				return true;
+		}
+		return false;
+	}
+}; // namespace
+
+
+
+// ScanIndex
+ScanIndex::ScanIndex() : done(false), scan_end(0), prev_end(0), pending(0) { }
+
+
+bool ScanIndex::open(string filename, string corrupt_filename, int64_t mdat_begin, int64_t file_size,
+                     const vector<string> &codecs) {
+	// A changed file (truncated, appended to or another recording) has other offsets.
+	struct stat info;
+	int64_t mtime = (stat(corrupt_filename.c_str(), &info) == 0) ? int64_t(info.st_mtime) : 0;
+
+	vector<unsigned char> header(Magic, Magic + sizeof(Magic));
+	putVarint(header, Version);
+	putVarint(header, mdat_begin);
+	putVarint(header, file_size);
+	putVarint(header, mtime);
+	putVarint(header, codecs.size());
+	for(unsigned int i = 0; i < codecs.size(); ++i) {
+		putVarint(header, codecs[i].size());
+		header.insert(header.end(), codecs[i].begin(), codecs[i].end());
+	}
+
+	int64_t valid = load(filename, header);
+	if(valid > 0) {
+		clog << "Resuming from index: " << filename << ": " << found.size() << " samples"
+			 << (done ? ", complete" : "") << ".\n";
+		return file.modify(filename) && file.truncate(valid);
+	}
+
+	found.clear();
+	done     = false;
+	scan_end = 0;
+	prev_end = 0;
+	if(!file.create(filename))
+		return false;
+	write(header);
+	return file.flush();
+}
+
+// Returns the size of the complete records, or 0 if the index can't be used.
+int64_t ScanIndex::load(string filename, const vector<unsigned char> &header) {
+	File in;
+	if(!in.open(filename) || in.isStream() || in.size() < off_t(header.size()))
+		return 0;
+	vector<unsigned char> buf(static_cast<size_t>(in.size()));
+	if(in.readAt(0, &buf[0], buf.size()) != ssize_t(buf.size()))
+		return 0;
+	if(!equal(header.begin(), header.end(), buf.begin())) {
+		clog << "Index does not match, scanning again: " << filename << '\n';
+		return 0;
+	}
+
+	size_t pos   = header.size();
+	size_t valid = pos;
+	while(pos < buf.size() && !done) {
+		uint64_t type, gap, size, duration;
+		if(!getVarint(buf, pos, type) || !getVarint(buf, pos, gap))
+			break;
+		if(type == 0) {
+			scan_end = prev_end + gap;
+			done     = true;
+		} else {
+			if(!getVarint(buf, pos, size) || !getVarint(buf, pos, duration))
+				break;
+			Sample sample;
+			sample.track    = static_cast<int>((type - 1) >> 1);
+			sample.keyframe = ((type - 1) & 1) != 0;
+			sample.offset   = prev_end + gap;
+			sample.size     = static_cast<int>(size);
+			sample.duration = static_cast<int>(duration);
+			found.push_back(sample);
+			prev_end = scan_end = sample.offset + sample.size;
+		}
+		valid = pos;
+	}
+	return valid;
+}
+
+
+void ScanIndex::add(const Sample &sample) {
+	vector<unsigned char> record;
+	putVarint(record, 1 + ((uint64_t(sample.track) << 1) | (sample.keyframe ? 1 : 0)));
+	putVarint(record, sample.offset - prev_end);
+	putVarint(record, uint32_t(sample.size));
+	putVarint(record, uint32_t(sample.duration));
+	write(record);
+	prev_end = scan_end = sample.offset + sample.size;
+}
+
+void ScanIndex::finish(int64_t offset) {
+	if(done)
+		return;
+	vector<unsigned char> record;
+	putVarint(record, 0);
+	putVarint(record, max(offset, prev_end) - prev_end);
+	write(record);
+	scan_end = max(offset, prev_end);
+	done     = true;
+	file.flush();
+}
+
+void ScanIndex::write(const vector<unsigned char> &record) {
+	if(file.writeChar(reinterpret_cast<const char*>(&record[0]), record.size()) != ssize_t(record.size()))
+		throw string("Could not write index");
+	if(++pending >= INDEX_FLUSH_RECORDS) {
+		if(!file.flush())
+			throw string("Could not write index");
+		pending = 0;
+	}
+}
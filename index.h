@@ -0,0 +1,79 @@
+//==================================================================//
+/*
+	Untrunc - index.h
+
+	Untrunc is GPL software; you can freely distribute,
+	redistribute, modify & use under the terms of the GNU General
+	Public License; either version 2 or its successor.
+
+	Untrunc is distributed under the GPL "AS IS", without
+	any warranty; without the implied warranty of merchantability
+	or fitness for either an expressed or implied particular purpose.
+
+	Please see the included GNU General Public License (GPL) for
+	your rights and further details; see the file COPYING. If you
+	cannot, write to the Free Software Foundation, 59 Temple Place
+	Suite 330, Boston, MA 02111-1307, USA.  Or www.fsf.org
+
+	Copyright 2010 Federico Ponchio
+                                                                    */
+//==================================================================//
+
+#ifndef INDEX_H
+#define INDEX_H
+
+#include <vector>
+#include <string>
+extern "C" {
+#include <stdint.h>
+}
+
+#include "file.h"
+
+
+// Sidecar file with the samples found by a scan of mdat, so a repair can resume.
+// The samples are appended as they are found, a final record marks a complete scan.
+// Offsets are relative to the mdat content, like Track::offsets before saving.
+class ScanIndex {
+public:
+	struct Sample {
+		int     track;
+		bool    keyframe;
+		int64_t offset;
+		int     size;
+		int     duration;   // Reported by the codec (mp4a), 0 if unknown.
+	};
+
+	ScanIndex();
+
+	// Load the samples of an earlier scan of the same mdat with the same tracks,
+	//  or start a new index if there is none (or it doesn't match).
+	// The corrupt file must have the same size and modification time.
+	bool open(std::string filename, std::string corrupt_filename, int64_t mdat_begin, int64_t file_size,
+	          const std::vector<std::string> &codecs);
+
+	const std::vector<Sample> &samples() const { return found; }
+	bool    complete() const { return done; }
+	int64_t end()      const { return scan_end; }  // Where to resume the scan.
+
+	void add   (const Sample &sample);
+	void finish(int64_t offset);  // The scan stopped at offset.
+
+protected:
+	File                file;
+	std::vector<Sample> found;
+	bool                done;
+	int64_t             scan_end;
+	int64_t             prev_end;  // Of the last sample, offsets are stored from it.
+	int                 pending;   // Records not flushed yet.
+
+	int64_t load(std::string filename, const std::vector<unsigned char> &header);
+	void    write(const std::vector<unsigned char> &record);
+
+private:
+	// Disable copying (File can't be copied).
+	ScanIndex(const ScanIndex&);
+	ScanIndex& operator=(const ScanIndex&);
+};
+
+#endif // INDEX_H
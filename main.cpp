@@ -20,25 +20,54 @@
 
 #include "mp4.h"
 #include "atom.h"
+#include "file.h"
 
 #include <iostream>
 #include <string>
+#include <algorithm>    // for: max()
+#include <cstdlib>      // for: atoi()
 using namespace std;
 
 void usage() {
-	cerr << "Usage: untrunc [-a -i] <ok.mp4> [<corrupt.mp4>]\n\n";
+	cerr << "Usage: untrunc [-a -i -j -d -s -p -x -e -f[N] -t[N]] <ok.mp4> [<corrupt.mp4> [<output.mp4>]]\n\n"
+	     << "  -a  analyze the samples of <ok.mp4>\n"
+	     << "  -i  print media info and atoms of <ok.mp4>\n"
+	     << "  -j  print the atoms of <ok.mp4> to stdout as JSON, with complete sample tables\n"
+	     << "  -d  read <corrupt.mp4> with direct I/O, bypassing the page cache\n"
+	     << "  -s  read <corrupt.mp4> forward only, as a stream (implied by - for stdin)\n"
+	     << "  -p  repair <corrupt.mp4> in place, appending the new moov to it\n"
+	     << "  -x  keep the samples found in <corrupt.mp4>.idx, and resume from it\n"
+	     << "  -e  <corrupt.mp4> lists its extents, a line each: <offset> <length> <path>\n"
+	     << "  -f  write a fragmented mp4, with a fragment every N keyframes (default 1)\n"
+	     << "  -t  scan <corrupt.mp4> with N threads (default one per core)\n\n"
+	     << "  <output.mp4> defaults to <corrupt.mp4>_fixed.mp4, - writes it to stdout with moov last\n\n";
 }
 
 int main(int argc, char *argv[]) {
 
     bool info = false;
+    bool json = false;
     bool analyze = false;
+    bool stream = false;
+    bool in_place = false;
+    bool use_index = false;
+    int  fragment_keyframes = 0;
+    int  threads = 1;
+    int  file_flags = 0;
     int i = 1;
     for(; i < argc; i++) {
         string arg(argv[i]);
-        if(arg[0] == '-') {
+        if(arg[0] == '-' && arg.size() > 1) {
             if(arg[1] == 'i') info = true;
+            if(arg[1] == 'j') json = true;
             if(arg[1] == 'a') analyze = true;
+            if(arg[1] == 'd') file_flags |= File::DirectIO;
+            if(arg[1] == 's') stream = true;
+            if(arg[1] == 'p') in_place = true;
+            if(arg[1] == 'x') use_index = true;
+            if(arg[1] == 'e') file_flags |= File::ExtentList;
+            if(arg[1] == 'f') fragment_keyframes = (arg.size() > 2) ? max(atoi(arg.c_str() + 2), 1) : 1;
+            if(arg[1] == 't') threads = (arg.size() > 2) ? max(atoi(arg.c_str() + 2), 1) : 0;
         } else
             break;
     }
@@ -49,29 +78,75 @@ int main(int argc, char *argv[]) {
 
     string ok = argv[i];
     string corrupt;
+    string output;
     i++;
     if(i < argc)
-        corrupt = argv[i];
+        corrupt = argv[i++];
+    if(i < argc)
+        output = argv[i];
+    if(corrupt == "-" || output == "-")
+        stream = true;
+    string index = use_index ? corrupt + ".idx" : string();
+    if(output.empty() && corrupt.size())
+        output = (corrupt == "-") ? string("stdin_fixed.mp4") : corrupt + "_fixed.mp4";
+
+    // Keep messages out of the video or JSON on stdout.
+    streambuf *cout_buf = cout.rdbuf();
+    if(output == "-" || json)
+        cout.rdbuf(cerr.rdbuf());
 
     cout << "Reading: " << ok << endl;
     Mp4 mp4;
 
     try {
-        mp4.open(ok);
+        mp4.open(ok, info);
         if(info) {
             mp4.printMediaInfo();
             mp4.printAtoms();
         }
+        if(json) {
+            ostream json_out(cout_buf);
+            mp4.printAtomsJson(json_out);
+        }
         if(analyze) {
             mp4.analyze();
         }
-        if(corrupt.size()) {
-            mp4.repair(corrupt);
-            mp4.saveVideo(corrupt + "_fixed.mp4");
+        if(corrupt.size() && fragment_keyframes > 0) {
+            if(in_place)
+                throw string("A fragmented repair can't be done in place");
+            if(use_index)
+                throw string("A fragmented repair can't keep a scan index");
+            if(threads != 1)
+                throw string("A fragmented repair can't be done in parallel");
+            if(json && output == "-")
+                throw string("The JSON atoms and the video can't both go to stdout");
+            mp4.repairFragmented(corrupt, output, fragment_keyframes, file_flags);
+        } else if(corrupt.size() && stream) {
+            if(in_place)
+                throw string("A stream can't be repaired in place");
+            if(use_index)
+                throw string("A stream repair can't keep a scan index");
+            if(threads != 1)
+                throw string("A stream can't be repaired in parallel");
+            if(json && output == "-")
+                throw string("The JSON atoms and the video can't both go to stdout");
+            mp4.repairStream(corrupt, output, file_flags);
+        } else if(corrupt.size() && use_index && threads != 1) {
+            throw string("A parallel repair can't keep a scan index");
+        } else if(corrupt.size() && in_place) {
+            if(file_flags & File::ExtentList)
+                throw string("A list of extents can't be repaired in place");
+            mp4.repair(corrupt, file_flags, index, threads);
+            mp4.saveInPlace(corrupt);
+        } else if(corrupt.size()) {
+            mp4.repair(corrupt, file_flags, index, threads);
+            mp4.saveVideo(output);
         }
     } catch(string e) {
         cerr << e << endl;
+        cout.rdbuf(cout_buf);
         return -1;
     }
+    cout.rdbuf(cout_buf);
     return 0;
 }
@@ -26,6 +26,8 @@
 #include <ios>          // Pre-C++11: may not be included by <iostream>.
 #include <iomanip>
 #include <limits>
+#include <cstring>      // for: memcmp(), memcpy()
+#include <algorithm>    // for: lower_bound()
 
 #ifndef  __STDC_LIMIT_MACROS
 # define __STDC_LIMIT_MACROS    1
@@ -38,7 +40,8 @@ extern "C" {
 #ifdef _WIN32
 # include <io.h>        // for: _isatty()
 #else
-# include <unistd.h>    // for: isatty()
+# include <unistd.h>    // for: isatty(), sysconf()
+# include <pthread.h>
 #endif
 #include "libavcodec/avcodec.h"
 #include "libavformat/avformat.h"
@@ -48,6 +51,7 @@ extern "C" {
 #include "mp4.h"
 #include "atom.h"
 #include "file.h"
+#include "index.h"
 
 
 // Stdio file descriptors.
@@ -64,6 +68,510 @@ using namespace std;
 namespace {
 	const int MaxFrameLength = 16000000;
 
+	// Samples per mdat when writing to a pipe, or at most in a fragment.
+	const size_t MdatBatchSize = 16 << 20;
+
+	void appendBE32(vector<unsigned char> &buf, uint32_t value) {
+		for(int i = 0; i < 4; ++i)
+			buf.push_back(static_cast<unsigned char>(value >> (24 - 8*i)));
+	}
+
+	void appendBE64(vector<unsigned char> &buf, uint64_t value) {
+		appendBE32(buf, uint32_t(value >> 32));
+		appendBE32(buf, uint32_t(value));
+	}
+
+	// Start an atom in buf, its length is set by endAtom().
+	size_t beginAtom(vector<unsigned char> &buf, const char *name) {
+		size_t begin = buf.size();
+		appendBE32(buf, 0);
+		buf.insert(buf.end(), name, name + 4);
+		return begin;
+	}
+
+	void endAtom(vector<unsigned char> &buf, size_t begin) {
+		uint32_t length = uint32_t(buf.size() - begin);
+		for(int i = 0; i < 4; ++i)
+			buf[begin + i] = static_cast<unsigned char>(length >> (24 - 8*i));
+	}
+
+	// Where scan() writes the samples of a track as it finds them.
+	class SampleWriter {
+	public:
+		virtual ~SampleWriter() { }
+		// Returns the offset of the sample in the output, if it is known.
+		virtual off_t write(int track, const unsigned char *sample, int length, bool keyframe, int duration) = 0;
+		virtual void  finish() = 0;
+	};
+
+	// Write samples into the mdat of an output as they are found.
+	// Seekable outputs get one mdat, with its 64-bit size filled in at the end.
+	// Pipes can't be patched: they get a complete mdat for every batch of samples.
+	class MdatWriter : public SampleWriter {
+		File  *output;
+		off_t  header;  // Of the mdat being written to, or -1.
+		vector<unsigned char> batch;
+
+		void writeBatch() {
+			if(batch.empty())
+				return;
+			output->writeInt(static_cast<int32_t>(8 + batch.size()));
+			output->writeChar("mdat", 4);
+			if(output->writeChar(reinterpret_cast<const char*>(&batch[0]), batch.size()) != ssize_t(batch.size()))
+				throw string("Could not write samples");
+			batch.clear();
+		}
+
+	public:
+		explicit MdatWriter(File *output) : output(output), header(-1) { }
+
+		off_t write(int, const unsigned char *sample, int length, bool, int) {
+			if(output->isStream()) {
+				if(!batch.empty() && batch.size() + length > MdatBatchSize)
+					writeBatch();
+				off_t offset = output->pos() + 8 + batch.size();
+				batch.insert(batch.end(), sample, sample + length);
+				return offset;
+			}
+			if(header < 0) {
+				header = output->pos();
+				output->writeInt(1);
+				output->writeChar("mdat", 4);
+				output->writeInt64(0);
+			}
+			off_t offset = output->pos();
+			if(output->writeChar(reinterpret_cast<const char*>(sample), length) != length)
+				throw string("Could not write sample");
+			return offset;
+		}
+
+		void finish() {
+			writeBatch();
+			if(header < 0)
+				return;
+			uint64_t size = output->pos() - header;
+			unsigned char size64[8];
+			for(int i = 0; i < 8; ++i)
+				size64[i] = static_cast<unsigned char>(size >> (56 - 8*i));
+			if(output->writeAt(header + 8, size64, sizeof(size64)) != sizeof(size64))
+				throw string("Could not write mdat size");
+			header = -1;
+		}
+	};
+
+	// Write samples as fragments of a fragmented mp4: a moof with a traf per track
+	//  and an mdat, which start at every fragment_keyframes keyframes of the first
+	//  track with keyframes (or when MdatBatchSize is reached).
+	// Only the samples of the current fragment are kept, their offsets aren't returned.
+	class FragmentWriter : public SampleWriter {
+		struct Sample {
+			int  size;
+			int  duration;
+			bool keyframe;
+		};
+
+		File          *output;
+		vector<Track> &tracks;
+		int            fragment_keyframes;
+		int            key_track;       // Starts the fragments, or -1.
+		uint32_t       sequence;
+		vector<bool>     sync;          // Tracks without stss: every sample is a keyframe.
+		vector<uint32_t> track_ids;
+		vector<uint64_t> decode_times;  // Of the next fragment, per track.
+		vector<size_t>   counts;        // Samples written, per track.
+		vector<vector<Sample> >        samples;
+		vector<vector<unsigned char> > data;
+		size_t         data_size;
+		int            keyframes;
+
+		void writeFragment() {
+			if(data_size == 0)
+				return;
+			vector<unsigned char> moof;
+			size_t moof_begin = beginAtom(moof, "moof");
+			size_t mfhd = beginAtom(moof, "mfhd");
+			appendBE32(moof, 0);
+			appendBE32(moof, ++sequence);
+			endAtom(moof, mfhd);
+
+			vector<size_t> data_offsets;  // Where to put them in moof.
+			for(unsigned int t = 0; t < tracks.size(); ++t) {
+				if(samples[t].empty())
+					continue;
+				size_t traf = beginAtom(moof, "traf");
+				size_t tfhd = beginAtom(moof, "tfhd");
+				appendBE32(moof, 0x020000);         // Default base is moof.
+				appendBE32(moof, track_ids[t]);
+				endAtom(moof, tfhd);
+				size_t tfdt = beginAtom(moof, "tfdt");
+				appendBE32(moof, 0x01000000);       // Version 1: 64-bit time.
+				appendBE64(moof, decode_times[t]);
+				endAtom(moof, tfdt);
+				size_t trun = beginAtom(moof, "trun");
+				appendBE32(moof, 0x000701);         // Data offset, sample durations, sizes and flags.
+				appendBE32(moof, samples[t].size());
+				data_offsets.push_back(moof.size());
+				appendBE32(moof, 0);
+				for(unsigned int i = 0; i < samples[t].size(); ++i) {
+					const Sample &sample = samples[t][i];
+					appendBE32(moof, sample.duration);
+					appendBE32(moof, sample.size);
+					// Depends on no other sample, or depends on others and is not a sync sample.
+					appendBE32(moof, (sample.keyframe || sync[t]) ? 0x02000000 : 0x01010000);
+					decode_times[t] += sample.duration;
+				}
+				endAtom(moof, trun);
+				endAtom(moof, traf);
+			}
+			endAtom(moof, moof_begin);
+
+			// The data of each track follows the mdat header, in track order.
+			uint32_t offset = uint32_t(moof.size() + 8);
+			for(unsigned int t = 0, i = 0; t < tracks.size(); ++t) {
+				if(samples[t].empty())
+					continue;
+				for(int b = 0; b < 4; ++b)
+					moof[data_offsets[i] + b] = static_cast<unsigned char>(offset >> (24 - 8*b));
+				offset += data[t].size();
+				++i;
+			}
+
+			if(output->writeChar(reinterpret_cast<const char*>(&moof[0]), moof.size()) != ssize_t(moof.size()))
+				throw string("Could not write fragment");
+			output->writeInt(static_cast<int32_t>(8 + data_size));
+			output->writeChar("mdat", 4);
+			for(unsigned int t = 0; t < tracks.size(); ++t) {
+				if(!data[t].empty() &&
+				   output->writeChar(reinterpret_cast<const char*>(&data[t][0]), data[t].size()) != ssize_t(data[t].size()))
+					throw string("Could not write fragment");
+				samples[t].clear();
+				data[t].clear();
+			}
+			data_size = 0;
+			keyframes = 0;
+		}
+
+	public:
+		// keyframe_traks: had an stss in the reference, before the moov was emptied.
+		FragmentWriter(File *output, vector<Track> &tracks, const vector<Atom *> &keyframe_traks, int fragment_keyframes)
+			: output(output), tracks(tracks), fragment_keyframes(fragment_keyframes),
+			  key_track(-1), sequence(0), decode_times(tracks.size(), 0), counts(tracks.size(), 0),
+			  samples(tracks.size()), data(tracks.size()), data_size(0), keyframes(0) {
+			for(unsigned int t = 0; t < tracks.size(); ++t) {
+				bool has_stss = tracks[t].trak &&
+					find(keyframe_traks.begin(), keyframe_traks.end(), tracks[t].trak) != keyframe_traks.end();
+				if(has_stss && key_track < 0)
+					key_track = t;
+				sync.push_back(!has_stss);
+				Atom *tkhd = tracks[t].trak ? tracks[t].trak->atomByName("tkhd") : NULL;
+				// ASSUME: tkhd atom version 0.
+				track_ids.push_back(tkhd ? uint32_t(tkhd->readInt(12)) : t + 1);
+			}
+		}
+
+		off_t write(int track, const unsigned char *sample, int length, bool keyframe, int duration) {
+			bool starts = (track == key_track && keyframe);
+			if((starts && keyframes >= fragment_keyframes) || data_size + length > MdatBatchSize)
+				writeFragment();
+			if(starts)
+				++keyframes;
+
+			// Without a duration from the codec, repeat the times of the reference.
+			const Track &t = tracks[track];
+			if(duration == 0 && t.codec.name == "samr")
+				duration = 160;
+			else if(duration == 0 && !t.times.empty())
+				duration = t.times[counts[track] % t.times.size()];
+			++counts[track];
+
+			Sample s = { length, duration, keyframe };
+			samples[track].push_back(s);
+			data[track].insert(data[track].end(), sample, sample + length);
+			data_size += length;
+			return 0;
+		}
+
+		void finish() {
+			writeFragment();
+		}
+	};
+
+	// Open a corrupt file, or the list of its extents.
+	File *openCorrupt(const string &filename, int flags) {
+		File *file = (flags & File::ExtentList) ? new ExtentFile : new File;
+		if(!file->open(filename, flags)) {
+			delete file;
+			throw "Could not open file: " + filename;
+		}
+		return file;
+	}
+
+	uint32_t readBE32(const unsigned char *p) {
+		return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+	}
+
+	void writeBE32(unsigned char *p, uint32_t value) {
+		p[0] = static_cast<unsigned char>(value >> 24);
+		p[1] = static_cast<unsigned char>(value >> 16);
+		p[2] = static_cast<unsigned char>(value >>  8);
+		p[3] = static_cast<unsigned char>(value);
+	}
+
+	// Bytes in the run of zero 32-bit words at p (at least one word).
+	int zeroWords(const unsigned char *p, int n) {
+		static const unsigned char zero[4] = { 0, 0, 0, 0 };
+		int len = 4;
+		while(len + 4 <= n && memcmp(p + len, zero, 4) == 0)
+			len += 4;
+		return len;
+	}
+
+
+	// What the scan found at an offset of mdat.
+	enum ScanStep {
+		FoundSample,  // A sample of one of the tracks.
+		SkippedData,  // Zeros, holes or atoms that are not samples.
+		NoMatch,      // Nothing matched: the end of the samples.
+		EndOfData
+	};
+
+	// Match the data at offset to a sample of one of the tracks, tried in their order,
+	//  or skip what is not a sample.
+	// offset is moved past what was found; start points to the sample.
+	ScanStep matchAt(vector<Track> &tracks, TrackOrder &order, BufferedAtom *mdat, int64_t &offset,
+	                 ScanIndex::Sample &sample, const unsigned char *&start, bool log = true) {
+		//unsigned char *start = &mdat->content[offset];
+		int64_t maxlength64 = mdat->readable(offset, MaxFrameLength);
+		if(maxlength64 <= 0)
+			return EndOfData;
+		start = mdat->getFragment(offset, maxlength64);
+		int maxlength = static_cast<int>(maxlength64);
+
+		unsigned int begin = mdat->readInt(offset);
+		if(begin == 0) {
+#if 0 // AARRGH this sometimes is not very correct, unless it's all zeros.
+			// Skip zeros to next 000.
+			offset &= 0xfffff000;
+			offset += 0x1000;
+#else
+			// Jump over a hole at once, else over the zero words already read.
+			// The jump keeps the 4-byte grid of the zero words: the hole ends
+			//  aligned in the file, which mdat may not be.
+			int64_t data = offset + ((mdat->nextData(offset) - offset) & ~int64_t(3));
+			if(data > offset) {
+#ifdef VERBOSE1
+				if(log)
+					clog << "Skipping hole: " << offset << " - " << data << '\n';
+#endif
+				offset = data;
+				return SkippedData;
+			}
+			offset += zeroWords(start, maxlength);
+#endif
+			return SkippedData;
+		}
+
+#ifdef VERBOSE1
+		if(log) {
+			unsigned int next  = mdat->readInt(offset + 4);
+			clog << "Offset: " << setw(10) << offset
+				 << "  begin: " << hex << setw(5) << begin << ' ' << setw(8) << next << dec << '\n';
+		}
+#endif
+
+		// Long recordings can be split into several mdat: skip only the header of
+		//  a later one, its samples follow in the same region of the file.
+		int64_t size   = readBE32(start);
+		int     header = 8;
+		if(size == 1 && maxlength >= 16) {  // 64-bit size.
+			size   = (int64_t(readBE32(start + 8)) << 32) | readBE32(start + 12);
+			header = 16;
+		}
+		if(memcmp(start + 4, "mdat", 4) == 0) {
+			if(log)
+				clog << "Skipping header of 'Media Data container' atom (mdat): begin: 0x"
+					 << hex << size << dec << ".\n";
+			offset += header;
+			return SkippedData;
+		}
+
+		// Skip other atoms between the samples (a fake moov, free space, uuid...):
+		//  their name must be known and they must fit in mdat.
+		char name[5] = { 0 };
+		memcpy(name, start + 4, 4);
+		if(Atom::isKnown(name) && size >= header && size <= mdat->contentSize() - offset) {
+			if(log)
+				clog << "Skipping atom (" << name << "): begin: 0x" << hex << size << dec << ".\n";
+			offset += size;
+			return SkippedData;
+		}
+
+		const vector<int> &next = order.next();
+		for(unsigned int j = 0; j < next.size(); ++j) {
+			int    i     = next[j];
+			Track &track = tracks[i];
+			if(log)
+				clog << "Track " << i << " codec: " << track.codec.name << '\n';
+			// Sometime audio packets are difficult to match, but if they are the only ones....
+			if(tracks.size() > 1 && !track.codec.matchSample(start, maxlength)){
+				if(log)
+					cout << 'tracks.size() > 1 && !track.codec.matchSample(start, maxlength)\n';
+				continue;
+			}
+			int duration = 0;
+			int length   = track.codec.getLength(start, maxlength, duration);
+			if(length < -1 || length > MaxFrameLength) {
+				if(log)
+					clog << "\nInvalid length: " << length << ". Wrong match in track: " << i << ".\n";
+				continue;
+			}
+			if(length == -1 || length == 0) {
+				if(log)
+					cout << 'length == -1 || length == 0\n';
+				continue;
+			}
+			if(length >= maxlength){
+				if(log)
+					cout << 'length >= maxlength\n';
+				continue;
+			}
+#ifdef VERBOSE1
+			if(length > 8 && log)
+				clog << "Length: " << length << " found as: " << track.codec.name << '\n';
+#endif
+			sample.track    = i;
+			sample.keyframe = track.codec.isKeyframe(start, maxlength);
+			sample.offset   = offset;
+			sample.size     = length;
+			sample.duration = duration;
+			offset += length;
+			order.found(i);
+			return FoundSample;
+		}
+		return NoMatch;
+	}
+
+
+	// Samples matched in a row from a sync point.
+	const int SyncSamples = 8;
+	// Segments of a parallel scan are at least this long.
+	const int64_t MinSegmentSize = 8 << 20;
+
+	// A segment of mdat scanned by its own thread, with its own decoders and reader.
+	struct Segment {
+		vector<Track>  tracks;
+		TrackOrder     order;
+		BufferedAtom  *mdat;
+		int64_t        begin;
+		int64_t        end;
+		int64_t        stop;       // The first sample boundary at or after end, or where nothing matched.
+		bool           truncated;  // Nothing matched at stop.
+		vector<ScanIndex::Sample> samples;
+		string         error;
+
+		Segment() : mdat(NULL), begin(0), end(0), stop(0), truncated(false) { }
+	};
+
+	// The start of a segment is not a sample boundary: find an offset from which
+	//  SyncSamples samples follow each other. Returns end if there is none before it.
+	int64_t findSync(vector<Track> &tracks, TrackOrder order, BufferedAtom *mdat, int64_t offset, int64_t end) {
+		for(; offset < end; ++offset) {
+			order.reset();
+			int64_t next    = offset;
+			int     matched = 0;
+			ScanIndex::Sample    sample;
+			const unsigned char *start = NULL;
+			ScanStep step = SkippedData;
+			while(matched < SyncSamples && (step == FoundSample || step == SkippedData)) {
+				step = matchAt(tracks, order, mdat, next, sample, start, false);
+				if(step == FoundSample)
+					++matched;
+			}
+			if(matched == SyncSamples || (matched > 0 && step == EndOfData))
+				return offset;
+		}
+		return end;
+	}
+
+	void *scanSegment(void *arg) {
+		Segment &segment = *static_cast<Segment *>(arg);
+		try {
+			int64_t offset = segment.begin;
+			if(offset > 0)
+				offset = findSync(segment.tracks, segment.order, segment.mdat, segment.begin, segment.end);
+			while(offset < segment.end) {
+				ScanIndex::Sample    sample;
+				const unsigned char *start = NULL;
+				ScanStep step = matchAt(segment.tracks, segment.order, segment.mdat, offset, sample, start, false);
+				if(step == FoundSample)
+					segment.samples.push_back(sample);
+				else if(step == NoMatch)
+					segment.truncated = true;
+				if(step == NoMatch || step == EndOfData)
+					break;
+			}
+			segment.stop = offset;
+		} catch(string e) {
+			segment.error = e;
+		} catch(const char *e) {
+			segment.error = e;
+		} catch(...) {
+			segment.error = "Unknown error";
+		}
+		return NULL;
+	}
+
+	// Discards what is written to it.
+	class NullBuf : public streambuf {
+	protected:
+		int overflow(int c) { return traits_type::not_eof(c); }
+		streamsize xsputn(const char *, streamsize n) { return n; }
+	};
+
+	// Silence the C++ streams and libav while the scan threads run: their
+	//  messages would interleave. Their errors are reported afterwards.
+	class QuietLog {
+		NullBuf    null;
+		streambuf *out;
+		streambuf *err;
+		streambuf *log;
+		int        level;
+	public:
+		QuietLog() : out(cout.rdbuf()), err(cerr.rdbuf()), log(clog.rdbuf()), level(av_log_get_level()) {
+			cout.flush();
+			clog.flush();
+			cout.rdbuf(&null);
+			cerr.rdbuf(&null);
+			clog.rdbuf(&null);
+			av_log_set_level(AV_LOG_QUIET);
+		}
+		~QuietLog() {
+			cout.rdbuf(out);
+			cerr.rdbuf(err);
+			clog.rdbuf(log);
+			av_log_set_level(level);
+		}
+	};
+
+	// Order samples by offset, for lower_bound().
+	struct SampleBefore {
+		bool operator()(const ScanIndex::Sample &sample, int64_t offset) const {
+			return sample.offset < offset;
+		}
+	};
+
+	// The segments share the tracks, but not their decoders and readers.
+	void freeSegments(vector<Segment> &segments) {
+		for(unsigned int k = 0; k < segments.size(); ++k) {
+			Segment &segment = segments[k];
+			for(unsigned int i = 0; i < segment.tracks.size(); ++i)
+				avcodec_free_context(&segment.tracks[i].codec.context);
+			segment.tracks.clear();
+			delete segment.mdat;
+			segment.mdat = NULL;
+		}
+	}
+
 
 	// Store start-up addresses of C++ stdio stream buffers as identifiers.
 	// These addresses differ per process and must be statically linked in.
@@ -166,30 +674,31 @@ namespace {
 
 
 // Mp4
-Mp4::Mp4() : timescale(0), duration(0), root(NULL), context(NULL) { }
+Mp4::Mp4() : timescale(0), duration(0), source(NULL), root(NULL), context(NULL) { }
 
 Mp4::~Mp4() {
 	close();
 }
 
-void Mp4::open(string filename) {
+void Mp4::open(string filename, bool probe) {
 	clog << "Opening: " << filename << '\n';
 	close();
 
-	{  // Parse ok file.
-		File file;
-		if(!file.open(filename))
+	{  // Parse ok file, kept open: the atom contents are read only when used.
+		source = new File;
+		if(!source->open(filename))
 			throw "Could not open file: " + filename;
 
 		root = new Atom;
+		int64_t offset = 0;
 		do {
-			Atom *atom = new Atom;
-			atom->parse(file);
+			Atom *atom = root->addChild();
+			atom->parse(*source, offset);
 #ifdef VERBOSE1
 			clog << "Found atom: " << atom->name << '\n';
 #endif
-			root->children.push_back(atom);
-		} while(!file.atEnd());
+			offset = atom->start + atom->length;
+		} while(offset < source->size());
 	}  // {
 	file_name = filename;
 
@@ -206,29 +715,39 @@ void Mp4::open(string filename) {
 	timescale = mvhd->readInt(12);
 	duration  = mvhd->readInt(16);
 
-	{  // Setup AV library.
-		AvLog useAvLog();
-		// Register all formats and codecs.
-		av_register_all();
-		// Open video file.
+	if(probe)
+		probeFile();
+	parseTracks();
+}
+
+// Read the stream info with libav, which decodes samples from the whole file.
+void Mp4::probeFile() {
+	freeContexts();
+	AvLog useAvLog();
+	// Register all formats and codecs.
+	av_register_all();
+	// Open video file.
 #ifdef OLD_AVFORMAT_API
-		int error = av_open_input_file(&context, filename.c_str(), NULL, 0, NULL);
+	int error = av_open_input_file(&context, file_name.c_str(), NULL, 0, NULL);
 #else
-		int error = avformat_open_input(&context, filename.c_str(), NULL, NULL);
+	int error = avformat_open_input(&context, file_name.c_str(), NULL, NULL);
 #endif
-		if(error != 0)
-			throw "Could not parse AV file: " + filename;
+	if(error != 0)
+		throw "Could not parse AV file: " + file_name;
 
-		// Retrieve stream information.
+	// Retrieve stream information.
 #ifdef OLD_AVFORMAT_API
-		if(av_find_stream_info(context) < 0)
+	if(av_find_stream_info(context) < 0)
 #else
-		if(avformat_find_stream_info(context, NULL) < 0)
+	if(avformat_find_stream_info(context, NULL) < 0)
 #endif
-			throw string("Could not find stream info");
-	}  // {
+		throw string("Could not find stream info");
+}
 
-	parseTracks();
+void Mp4::freeContexts() {
+	for(unsigned int i = 0; i < contexts.size(); ++i)
+		avcodec_free_context(&contexts[i]);
+	contexts.clear();
 }
 
 void Mp4::close() {
@@ -237,6 +756,7 @@ void Mp4::close() {
 	timescale = 0;
 	duration  = 0;
 	tracks.clear();     // Must clear tracks before closing context.
+	freeContexts();
 	if(context) {
 		AvLog useAvLog(AV_LOG_ERROR);
 #ifdef OLD_AVFORMAT_API
@@ -248,6 +768,8 @@ void Mp4::close() {
 	}
 	file_name.clear();
 	delete rm_root;
+	delete source;
+	source = NULL;
 }
 
 void Mp4::printMediaInfo() {
@@ -269,21 +791,34 @@ void Mp4::printAtoms() {
 	}
 }
 
+void Mp4::printAtomsJson(ostream &out) {
+	if(root) {
+		out << '[';
+		for(unsigned int i = 0; i < root->children.size(); ++i) {
+			out << (i ? ",\n" : "\n");
+			root->children[i]->printJson(out);
+		}
+		out << "\n]\n";
+		out.flush();
+	}
+}
+
 bool Mp4::makeStreamable(string filename, string output_filename) {
 	clog << "Make Streamable: " << filename << '\n';
+	File input;  // The atoms read their content from it, up to the save.
 	Atom atom_root;
 	{  // Parse input file.
-		File file;
-		if(!file.open(filename))
+		if(!input.open(filename))
 			throw "Could not open file: " + filename;
 
-		while(!file.atEnd()) {
-			Atom *atom = new Atom;
-			atom->parse(file);
+		int64_t offset = 0;
+		while(offset < input.size()) {
+			Atom *atom = atom_root.addChild();
+			atom->parse(input, offset);
 #ifdef VERBOSE1
 			clog << "Found atom: " << atom->name << '\n';
 #endif
-			atom_root.children.push_back(atom);
+			offset = atom->start + atom->length;
 		}
 	}  // {
 
@@ -304,35 +839,33 @@ bool Mp4::makeStreamable(string filename, string output_filename) {
 	}
 
 	int64_t old_start = mdat->start  + 8;
-	int64_t new_start = moov->length + 8;
+	mdat->updateLength();  // Lengths of 64-bit atoms are read without their extra header.
+	int64_t new_start = moov->length + mdat->headerSize();
 	if(ftyp)
 		new_start += ftyp->length;
 
 	int64_t diff = new_start - old_start;
 	clog << "Old: " << old_start << " -> New: " << new_start << '\n';
-#if 0 // MIGHT HAVE TO FIX THIS ONE TOO?
-	Atom *co64 = trak->atomByName("co64");
-	if(co64) {
-		trak->prune("co64");
-		Atom *stbl = trak->atomByName("stbl");
-		if(stbl) {
-			Atom *new_stco = new Atom;
-			memcpy(new_stco->name, "stco", min(sizeof("stco"), sizeof(new_stco->name)-1));
-			stbl->children.push_back(new_stco);
-		}
-	}
-#endif
 	std::vector<Atom *> stcos = moov->atomsByName("stco");
 	for(unsigned int i = 0; i < stcos.size(); ++i) {
 		Atom *stco = stcos[i];
 		int32_t nchunks = stco->readInt(4); // 4 version, 4 number of entries, 4 entries.
 		for(int j = 0; j < nchunks; ++j) {
 			int64_t pos    = int64_t(8) + 4*j;
-			int64_t offset = stco->readInt(pos) + diff;
+			int64_t offset = uint32_t(stco->readInt(pos)) + diff;
 			clog << "O: " << offset << '\n';
 			stco->writeInt(offset, pos);
 		}
 	}
+	std::vector<Atom *> co64s = moov->atomsByName("co64");
+	for(unsigned int i = 0; i < co64s.size(); ++i) {
+		Atom *co64 = co64s[i];
+		int32_t nchunks = co64->readInt(4); // 4 version, 4 number of entries, 8 entries.
+		for(int j = 0; j < nchunks; ++j) {
+			int64_t pos = int64_t(8) + 8*j;
+			co64->writeInt64(co64->readInt64(pos) + diff, pos);
+		}
+	}
 
 	{  // Save to output file.
 		clog << "Saving to: " << output_filename << '\n';
@@ -344,6 +877,8 @@ bool Mp4::makeStreamable(string filename, string output_filename) {
 			ftyp->write(file);
 		moov->write(file);
 		mdat->write(file);
+		if(!file.flush())
+			throw "Could not write to file: " + output_filename;
 	}  // {
 	clog << endl;
 	return true;
@@ -364,6 +899,152 @@ bool Mp4::save(string output_filename) {
 		return false;
 	}
 
+	Atom *ftyp = root->atomByName("ftyp");
+	Atom *moov = updateMovie();
+	Atom *mdat = root->atomByName("mdat");
+	if(!moov)
+		return false;
+	if(!mdat) {
+		cerr << "Missing 'Media Data container' atom (mdat).\n";
+		return false;
+	}
+
+	root->updateLength();
+
+	// Fix offsets.
+	int64_t offset = moov->length + mdat->headerSize();
+	if(ftyp)
+		offset += ftyp->length; // Not all .mov have an ftyp.
+
+	// Offsets over 4GB switch stco to co64, which makes moov larger: shift again.
+	for(int64_t moov_length = moov->length; offset != 0; ) {
+		for(unsigned int t = 0; t < tracks.size(); ++t) {
+			Track &track = tracks[t];
+			for(unsigned int i = 0; i < track.offsets.size(); ++i)
+				track.offsets[i] += offset;
+
+			track.writeToAtoms();  // Need to save the offsets back to the atoms.
+		}
+		root->updateLength();
+		offset      = moov->length - moov_length;
+		moov_length = moov->length;
+	}
+
+	{  // Save to output file.
+		File file;
+		if(!file.create(output_filename))
+			throw "Could not create file for writing: " + output_filename;
+
+		if(ftyp)
+			ftyp->write(file);
+		moov->write(file);
+		mdat->write(file);
+		if(!file.flush())
+			throw "Could not write to file: " + output_filename;
+	}  // {
+	clog << endl;
+	return true;
+}
+
+// Save the repair into the corrupt file itself: patch the mdat header,
+//  cut the file after the last sample found and append the new moov.
+// Offsets stay relative to the original mdat position, so no sample is moved.
+bool Mp4::saveInPlace(string corrupt_filename) {
+	clog << "Saving in place: " << corrupt_filename << '\n';
+	if(!root) {
+		cerr << "No file opened.\n";
+		return false;
+	}
+	BufferedAtom *mdat = dynamic_cast<BufferedAtom *>(root->atomByName("mdat"));
+	if(!mdat) {
+		cerr << "No repaired 'Media Data container' atom (mdat).\n";
+		return false;
+	}
+
+	int64_t data_end = 0;
+	for(unsigned int t = 0; t < tracks.size(); ++t) {
+		Track &track = tracks[t];
+		for(unsigned int i = 0; i < track.offsets.size(); ++i)
+			data_end = max(data_end, track.offsets[i] + track.sizes[i]);
+	}
+
+	Atom *moov = updateMovie();
+	if(!moov)
+		return false;
+	for(unsigned int t = 0; t < tracks.size(); ++t) {
+		Track &track = tracks[t];
+		for(unsigned int i = 0; i < track.offsets.size(); ++i)
+			track.offsets[i] += mdat->file_begin;
+		track.writeToAtoms();
+	}
+	moov->updateLength();
+
+	File file;
+	if(!file.modify(corrupt_filename))
+		throw "Could not open file for writing: " + corrupt_filename;
+
+	// Find the header: 64-bit sizes are 16 bytes before the data, 32-bit ones 8.
+	unsigned char head[16] = { 0 };
+	int64_t from = max(int64_t(0), mdat->file_begin - 16);
+	size_t  n    = size_t(mdat->file_begin - from);
+	if(file.readAt(from, head + 16 - n, n) != ssize_t(n))
+		throw "Could not read mdat header: " + corrupt_filename;
+	bool    large  = (readBE32(head) == 1 && memcmp(head + 4, "mdat", 4) == 0);
+	int64_t header = mdat->file_begin - (large ? 16 : 8);
+	int64_t size   = mdat->file_begin + data_end - header;
+	if(!large && size > int64_t(UINT32_MAX)) {
+		// Grow into a preceding 8-byte 'wide' (or 'free') atom, as QuickTime does.
+		if(readBE32(head) == 8 && (memcmp(head + 4, "wide", 4) == 0 || memcmp(head + 4, "free", 4) == 0)) {
+			large  = true;
+			header -= 8;
+			size   += 8;
+		} else {
+			throw string("The mdat is too large for its 32-bit header, save a new file instead");
+		}
+	}
+
+	// An old moov before mdat is hidden, so players use the new one.
+	// Everything is read before the file is changed.
+	vector<int64_t> old_moovs;
+	for(int64_t pos = 0; pos < header; ) {
+		Atom atom;
+		atom.parseHeader(file, pos);
+		if(atom.name == string("moov"))
+			old_moovs.push_back(pos);
+		pos = atom.start + atom.length;
+	}
+	size_t  len   = large ? 16 : 4;
+	int64_t begin = old_moovs.empty() ? header : old_moovs[0] + 4;
+	vector<unsigned char> patch(size_t(header + len - begin));
+	if(header > begin && file.readAt(begin, &patch[0], size_t(header - begin)) != ssize_t(header - begin))
+		throw "Could not read file: " + corrupt_filename;
+	for(unsigned int i = 0; i < old_moovs.size(); ++i)
+		memcpy(&patch[size_t(old_moovs[i] + 4 - begin)], "free", 4);
+	unsigned char *mdat_head = &patch[size_t(header - begin)];
+	if(large) {
+		writeBE32(mdat_head, 1);
+		memcpy(mdat_head + 4, "mdat", 4);
+		for(int i = 0; i < 8; ++i)
+			mdat_head[8 + i] = static_cast<unsigned char>(uint64_t(size) >> (56 - 8*i));
+	} else {
+		writeBE32(mdat_head, uint32_t(size));
+	}
+
+	if(!file.truncate(mdat->file_begin + data_end))
+		throw "Could not truncate file: " + corrupt_filename;
+	moov->write(file);
+	if(!file.flush())
+		throw "Could not write to file: " + corrupt_filename;
+
+	// The mdat header and the old moov at once.
+	if(file.writeAt(begin, &patch[0], patch.size()) != ssize_t(patch.size()))
+		throw "Could not write to file: " + corrupt_filename;
+	clog << endl;
+	return true;
+}
+
+// Update the durations and the sample tables of the tracks in moov.
+Atom *Mp4::updateMovie() {
 	if(timescale == 0) {
 		timescale = 600;  // Default movie time scale.
 		clog << "Using new movie time scale: " << timescale << ".\n";
@@ -406,48 +1087,65 @@ bool Mp4::save(string output_filename) {
 		throw string("Missing 'Movie Header' atom (mvhd)");
 	mvhd->writeInt(duration, 16);
 
-	Atom *ftyp = root->atomByName("ftyp");
 	Atom *moov = root->atomByName("moov");
-	Atom *mdat = root->atomByName("mdat");
-	if(!moov || !mdat) {
-		if(!moov)
-			cerr << "Missing 'Container for all the Meta-data' atom (moov).\n";
-		if(!mdat)
-			cerr << "Missing 'Media Data container' atom (mdat).\n";
-		return false;
+	if(!moov) {
+		cerr << "Missing 'Container for all the Meta-data' atom (moov).\n";
+		return NULL;
 	}
 
 	moov->prune("ctts");
 	moov->prune("cslg");
 	moov->prune("stps");
+	return moov;
+}
 
-	root->updateLength();
-
-	// Fix offsets.
-	int64_t offset = moov->length + 8;
-	if(ftyp)
-		offset += ftyp->length; // Not all .mov have an ftyp.
-
-	for(unsigned int t = 0; t < tracks.size(); ++t) {
-		Track &track = tracks[t];
-		for(unsigned int i = 0; i < track.offsets.size(); ++i)
-			track.offsets[i] += offset;
-
-		track.writeToAtoms();  // Need to save the offsets back to the atoms.
+// The moov of a fragmented file: no samples and no durations, and a trex
+//  for every track in mvex (the samples are described by the fragments).
+Atom *Mp4::initMovie() {
+	Atom *moov = root->atomByName("moov");
+	if(!moov) {
+		cerr << "Missing 'Container for all the Meta-data' atom (moov).\n";
+		return NULL;
 	}
+	moov->prune("ctts");
+	moov->prune("cslg");
+	moov->prune("stps");
+	moov->prune("edts");  // Edit lists of the reference would cut the fragments.
+	moov->prune("mvex");
 
-	{  // Save to output file.
-		File file;
-		if(!file.create(output_filename))
-			throw "Could not create file for writing: " + output_filename;
+	Atom *mvhd = moov->atomByName("mvhd");
+	if(!mvhd)
+		throw string("Missing 'Movie Header' atom (mvhd)");
+	mvhd->writeInt(0, 16);
 
-		if(ftyp)
-			ftyp->write(file);
-		moov->write(file);
-		mdat->write(file);
-	}  // {
-	clog << endl;
-	return true;
+	Atom *mvex = moov->addChild("mvex");
+	keyframe_traks.clear();
+	for(unsigned int i = 0; i < tracks.size(); ++i) {
+		Track &track = tracks[i];
+		if(track.trak && track.trak->atomByName("stss"))
+			keyframe_traks.push_back(track.trak);
+		track.writeEmptyTables();
+		Atom *tkhd = track.trak ? track.trak->atomByName("tkhd") : NULL;
+		if(!tkhd) {
+			cerr << "Missing 'Track Header' atom (tkhd).\n";
+			continue;
+		}
+		tkhd->writeInt(0, 20);
+
+		Atom *trex = mvex->addChild("trex");
+		trex->contentResize(4 +  // Version.
+							4 +  // Track id.
+							4 +  // Default sample description.
+							12); // Default duration, size and flags: set by every trun.
+		trex->writeInt(0, 0);
+		trex->writeInt(tkhd->readInt(12), 4);
+		trex->writeInt(1, 8);
+		trex->writeInt(0, 12);
+		trex->writeInt(0, 16);
+		trex->writeInt(0, 20);
+	}
+	moov->updateLength();
+	return moov;
 }
 
 void Mp4::analyze(bool interactive) {
@@ -502,11 +1200,11 @@ void Mp4::analyze(bool interactive) {
 
 		for(unsigned int i = 0; i < track.offsets.size(); ++i) {
 			int64_t offset = track.offsets[i] - (mdat->start + 8);
-			unsigned char *start = &(mdat->content[offset]);
 			int64_t maxlength64 = mdat->contentSize() - offset;
 			if(maxlength64 > MaxFrameLength)
 				maxlength64 = MaxFrameLength;
 			int maxlength = static_cast<int>(maxlength64);
+			const unsigned char *start = mdat->contentData(offset, maxlength);
 
 			int64_t begin = mdat->readInt(offset);
 			int64_t next  = mdat->readInt(offset + 4);
@@ -563,55 +1261,63 @@ bool Mp4::parseTracks() {
 		return false;
 	}
 	vector<Atom *> traks = root->atomsByName("trak");
+	if(!context) {
+		for(unsigned int i = 0; i < traks.size(); ++i) {
+			AVCodecContext *codec_context = Codec::newContext(traks[i]);
+			if(!codec_context) {
+				clog << "Unknown codec in track " << i << ", probing the file.\n";
+				probeFile();
+				break;
+			}
+			contexts.push_back(codec_context);
+		}
+	}
 	for(unsigned int i = 0; i < traks.size(); ++i) {
 		Track track;
-		track.codec.context = context->streams[i]->codec;
+		track.codec.context = context ? context->streams[i]->codec : contexts[i];
 		track.parse(traks[i], mdat);
 		tracks.push_back(track);
 	}
 	return true;
 }
 
-bool Mp4::repair(string corrupt_filename) {
-	clog << "Repair: " << corrupt_filename << '\n';
-	BufferedAtom *mdat = NULL;
-	{  // Parse corrupt file.
-		File file;
-		if(!file.open(corrupt_filename))
-			throw "Could not open file: " + corrupt_filename;
-
-		// Find mdat.  This fails with krois and a few other.
-		// TODO: Check for multiple mdat, or just look for the first one.
-		while(true) {
-			Atom atom;
-			try {
-				atom.parseHeader(file);
-			} catch(string) {
-				throw string("Failed to parse atoms in truncated file");
-			}
-
-			if(atom.name != string("mdat")) {
-				off_t pos = file.pos();
-				file.seek(pos - 8 + atom.length);
-				continue;
-			}
-
-			mdat = new BufferedAtom(corrupt_filename);
-			mdat->start = atom.start;
-			memcpy(mdat->name, atom.name, sizeof(mdat->name)-1);
-			memcpy(mdat->head, atom.head, sizeof(mdat->head));
-			memcpy(mdat->version, atom.version, sizeof(mdat->version));
+// Find the mdat of a corrupt file; the returned atom owns the file.
+BufferedAtom *Mp4::findMdat(File *file) {
+	// Find mdat.  This fails with krois and a few other.
+	// Later mdat are scanned as part of the first one: see scan().
+	int64_t pos = 0;
+	while(true) {
+		Atom atom;
+		try {
+			atom.parseHeader(*file, pos);
+		} catch(string) {
+			delete file;
+			throw string("Failed to parse atoms in truncated file");
+		}
 
-			mdat->file_begin = file.pos();
-			mdat->file_end   = file.length() - file.pos();
-			//mdat->content = file.read(file.length() - file.pos());
-			break;
+		if(atom.name != string("mdat")) {
+			pos = atom.start + atom.length;
+			continue;
 		}
-	}  // {
 
-	for(unsigned int i = 0; i < tracks.size(); ++i)
-		tracks[i].clear();
+		BufferedAtom *mdat = new BufferedAtom(file);
+		mdat->start = atom.start;
+		memcpy(mdat->name, atom.name, sizeof(mdat->name)-1);
+		memcpy(mdat->head, atom.head, sizeof(mdat->head));
+		memcpy(mdat->version, atom.version, sizeof(mdat->version));
+
+		mdat->file_begin = atom.start + 8;
+		if(file->isStream())
+			mdat->file_end = numeric_limits<int64_t>::max();  // Found when the stream ends.
+		else
+			mdat->file_end = file->length();
+		//mdat->content = file.read(file.length() - file.pos());
+		return mdat;
+	}
+}
 
+// Clear the tracks for a scan, in the order the samples are matched to them.
+void Mp4::prepareTracks() {
 	// mp4a is more reliable than avc1.
 	if(tracks.size() > 1 && tracks[0].codec.name != "mp4a" && tracks[1].codec.name == "mp4a") {
 #ifdef VERBOSE1
@@ -620,98 +1326,76 @@ bool Mp4::repair(string corrupt_filename) {
 		swap(tracks[0], tracks[1]);
 	}
 
-	// mp4a can be decoded and reports the number of samples (duration in samplerate scale).
-	// In some videos the duration (stts) can be variable and we can rebuild them using these values.
-	vector<int> audiotimes;
-	unsigned long count = 0;
-	off_t offset = 0;
-	while(offset < mdat->contentSize()) {
-		//unsigned char *start = &mdat->content[offset];
-		int64_t maxlength64 = mdat->contentSize() - offset;
-		if(maxlength64 > MaxFrameLength)
-			maxlength64 = MaxFrameLength;
-		unsigned char *start = mdat->getFragment(offset, maxlength64);
-		int maxlength = static_cast<int>(maxlength64);
+	// From the samples of the reference file, before they are cleared.
+	if(!track_order.learned())
+		track_order.learn(tracks, root->atomByName("mdat"));
+	track_order.reset();
 
-		unsigned int begin = mdat->readInt(offset);
-		if(begin == 0) {
-#if 0 // AARRGH this sometimes is not very correct, unless it's all zeros.
-			// Skip zeros to next 000.
-			offset &= 0xfffff000;
-			offset += 0x1000;
-#else
-			offset += 4;
-#endif
-			continue;
-		}
+	for(unsigned int i = 0; i < tracks.size(); ++i)
+		tracks[i].clear();
+}
 
-#ifdef VERBOSE1
-		unsigned int next  = mdat->readInt(offset + 4);
-		clog << "Offset: " << setw(10) << offset
-			 << "  begin: " << hex << setw(5) << begin << ' ' << setw(8) << next << dec << '\n';
-#endif
+// The sample durations reported by mp4a go to the track with as many samples.
+void Mp4::finishTracks(vector<int> &audiotimes) {
+	for(unsigned int i = 0; i < tracks.size(); ++i) {
+		if(audiotimes.size() == tracks[i].offsets.size())
+			swap(audiotimes, tracks[i].times);
 
-		// Skip fake moov.
-		if(start[4] == 'm' && start[5] == 'o' && start[6] == 'o' && start[7] == 'v') {
-			clog << "Skipping 'Container for all the Meta-data' atom (moov): begin: 0x"
-				 << hex << swap32(begin) << dec << ".\n";
-			offset += swap32(begin);
-			continue;
-		}
+		tracks[i].fixTimes();
+	}
+}
 
-		//skip free block!
-		if(start[4] == 'f' && start[5] == 'r' && start[6] == 'e' && start[7] == 'e') {
-			clog << "Skipping 'Container for all the Meta-data' atom (moov): begin: 0x"
-				 << hex << swap32(begin) << dec << ".\n";
-			offset += swap32(begin);
-			continue;
-		}
+// Match the samples in mdat to the tracks.
+// With an output, the samples are written to it as they are found and
+//  their offsets are the absolute positions in the output,
+//  or they are written as fragments (and the tracks keep no sample tables).
+void Mp4::scan(BufferedAtom *mdat, File *output, ScanIndex *index, int fragment_keyframes) {
+	prepareTracks();
 
-		bool found = false;
-		for(unsigned int i = 0; i < tracks.size(); ++i) {
-			Track &track = tracks[i];
-			clog << "Track " << i << " codec: " << track.codec.name << '\n';
-			// Sometime audio packets are difficult to match, but if they are the only ones....
-			if(tracks.size() > 1 && !track.codec.matchSample(start, maxlength)){
-				cout << 'tracks.size() > 1 && !track.codec.matchSample(start, maxlength)\n';
-				continue;
-			}
-			int duration = 0;
-			int length   = track.codec.getLength(start, maxlength, duration);
-			if(length < -1 || length > MaxFrameLength) {
-				clog << "\nInvalid length: " << length << ". Wrong match in track: " << i << ".\n";
-				continue;
-			}
-			if(length == -1 || length == 0) {
-				cout << 'length == -1 || length == 0\n';
-				continue;
-			}
-			if(length >= maxlength){
-				cout << 'length >= maxlength\n';
-				continue;
-			}
-#ifdef VERBOSE1
-			if(length > 8)
-				clog << "Length: " << length << " found as: " << track.codec.name << '\n';
-#endif
-			bool keyframe = track.codec.isKeyframe(start, maxlength);
-			if(keyframe)
+	// mp4a can be decoded and reports the number of samples (duration in samplerate scale).
+	// In some videos the duration (stts) can be variable and we can rebuild them using these values.
+	vector<int> audiotimes;
+	unsigned long count = 0;
+	off_t offset = 0;
+	if(index) {
+		// Take the samples of an earlier scan and continue after them.
+		const vector<ScanIndex::Sample> &found = index->samples();
+		for(unsigned int i = 0; i < found.size(); ++i) {
+			const ScanIndex::Sample &sample = found[i];
+			if(sample.track < 0 || sample.track >= int(tracks.size()))
+				throw string("Invalid track in scan index");
+			Track &track = tracks[sample.track];
+			if(sample.keyframe)
 				track.keyframes.push_back(track.offsets.size());
-			track.offsets.push_back(offset);
-			track.sizes.push_back(length);
-			offset += length;
-
-			if(duration)
-				audiotimes.push_back(duration);
-
-			found = true;
-			break;
+			track.offsets.push_back(sample.offset);
+			track.sizes.push_back(sample.size);
+			if(sample.duration)
+				audiotimes.push_back(sample.duration);
+			track_order.found(sample.track);
 		}
+		count  = found.size();
+		offset = index->end();
+		if(index->complete() && mdat->file_begin + offset < mdat->file_end) {
+			mdat->file_end = mdat->file_begin + offset;
+			mdat->length   = mdat->file_end - mdat->file_begin;
+		}
+	}
+	MdatWriter     mdat_writer(output);
+	FragmentWriter fragment_writer(output, tracks, keyframe_traks, fragment_keyframes);
+	SampleWriter  &writer = (fragment_keyframes > 0) ? static_cast<SampleWriter&>(fragment_writer) : mdat_writer;
+	while(!(index && index->complete()) && offset < mdat->contentSize()) {
+		ScanIndex::Sample    sample;
+		const unsigned char *start = NULL;
+		ScanStep step = matchAt(tracks, track_order, mdat, offset, sample, start);
 #ifdef VERBOSE1
-		clog << '\n';
+		if(step == FoundSample || step == NoMatch)
+			clog << '\n';
 #endif
-
-		if(!found) {
+		if(step == EndOfData)
+			break;  // End of stream.
+		if(step == SkippedData)
+			continue;
+		if(step == NoMatch) {
 			cout << '!found\n';
 			// This could be a problem for large files.
 			//assert(mdat->contentSize() + 8 == mdat->length);
@@ -721,16 +1405,214 @@ bool Mp4::repair(string corrupt_filename) {
 			//mdat->length = mdat->contentSize() + 8;
 			break;
 		}
+
+		if(fragment_keyframes > 0) {
+			// The fragments describe the samples: memory doesn't grow with the file.
+			writer.write(sample.track, start, sample.size, sample.keyframe, sample.duration);
+			count++;
+			continue;
+		}
+
+		Track &track = tracks[sample.track];
+		if(sample.keyframe)
+			track.keyframes.push_back(track.offsets.size());
+		if(output) {
+			track.offsets.push_back(writer.write(sample.track, start, sample.size, sample.keyframe, sample.duration));
+		} else {
+			track.offsets.push_back(sample.offset);
+		}
+		track.sizes.push_back(sample.size);
+		if(index)
+			index->add(sample);
+
+		if(sample.duration)
+			audiotimes.push_back(sample.duration);
 		count++;
 	}
 
 	clog << "Found " << count << " packets.\n";
+	if(output)
+		writer.finish();
+	if(index)
+		index->finish(offset);
 
-	for(unsigned int i = 0; i < tracks.size(); ++i) {
-		if(audiotimes.size() == tracks[i].offsets.size())
-			swap(audiotimes, tracks[i].times);
+	if(fragment_keyframes == 0)
+		finishTracks(audiotimes);
+}
 
-		tracks[i].fixTimes();
+// Match the samples in mdat to the tracks with a thread per segment of mdat.
+// Each thread starts at a sync point in its segment and goes on to the first sample
+//  boundary after it. The segments are joined where the samples before them end:
+//  the samples from there to a sample of the segment are matched again here, and
+//  the segment is taken from the first sample that is matched the same way.
+// The threads start with cold decoders and track order at their sync point, so in
+//  rare cases the samples after a joint can differ from those of one scan.
+// Without a decoder per thread (codecs not known to Codec::newContext) mdat is scanned in one go.
+void Mp4::scanSegments(BufferedAtom *mdat, string filename, int file_flags, int threads) {
+#ifdef _WIN32
+	// No pthreads.
+	(void)filename;
+	(void)file_flags;
+	(void)threads;
+	scan(mdat);
+#else
+	int64_t size  = mdat->contentSize();
+	int     count = int(min<int64_t>(threads, size / MinSegmentSize));
+	if(count < 2) {
+		scan(mdat);
+		return;
+	}
+	prepareTracks();
+
+	vector<Segment> segments(count);
+	vector<pthread_t> ids;
+	try {
+		for(int k = 0; k < count; ++k) {
+			Segment &segment = segments[k];
+			segment.tracks = tracks;
+			segment.order  = track_order;
+			segment.begin  = size * k / count;
+			segment.end    = size * (k + 1) / count;
+			segment.stop   = segment.end;
+			for(unsigned int i = 0; i < tracks.size(); ++i)
+				segment.tracks[i].codec.context = NULL;
+			for(unsigned int i = 0; i < tracks.size(); ++i) {
+				Codec &codec = segment.tracks[i].codec;
+				codec.context = Codec::newContext(tracks[i].trak);
+				if(!codec.context) {
+					clog << "No decoder for every thread, scanning in one thread.\n";
+					freeSegments(segments);
+					scan(mdat);
+					return;
+				}
+				if(tracks[i].codec.codec)
+					codec.open();
+			}
+			segment.mdat = new BufferedAtom(openCorrupt(filename, file_flags));
+			segment.mdat->file_begin = mdat->file_begin;
+			segment.mdat->file_end   = mdat->file_end;
+		}
+
+		clog << "Scanning " << count << " segments in parallel.\n";
+		ids.resize(count);
+		int started = 0;
+		{
+			QuietLog quiet;
+			while(started < count && pthread_create(&ids[started], NULL, scanSegment, &segments[started]) == 0)
+				++started;
+			for(int k = 0; k < started; ++k)
+				pthread_join(ids[k], NULL);
+		}
+		if(started < count)
+			throw string("Could not start scan thread");
+	} catch(...) {
+		freeSegments(segments);
+		throw;
+	}
+
+	vector<ScanIndex::Sample> samples;
+	int64_t offset    = 0;
+	bool    truncated = false;
+	int     matched   = 0;  // Again, at the joints.
+	try {
+		for(unsigned int k = 0; k < segments.size() && !truncated; ++k) {
+			Segment &segment = segments[k];
+			if(!segment.error.empty()) {
+				// Its samples will be matched here, if they are reached.
+				clog << "Segment " << k << ": " << segment.error << '\n';
+				segment.samples.clear();
+				segment.stop      = segment.end;
+				segment.truncated = false;
+			}
+			vector<ScanIndex::Sample>::iterator joint = segment.samples.end();
+			bool joined = false;
+			while(offset < segment.stop) {
+				joint = lower_bound(segment.samples.begin(), segment.samples.end(), offset, SampleBefore());
+				if(joint != segment.samples.end() && joint->offset != offset)
+					joint = segment.samples.end();
+
+				ScanIndex::Sample    sample;
+				const unsigned char *start = NULL;
+				ScanStep step = matchAt(tracks, track_order, mdat, offset, sample, start, false);
+				if(step == FoundSample) {
+					samples.push_back(sample);
+					++matched;
+					// The segment goes on from here only if it matched this sample the same way.
+					joined = (joint != segment.samples.end() && joint->track == sample.track && joint->size == sample.size);
+					if(joined)
+						break;
+				} else if(step == NoMatch) {
+					truncated = true;
+				}
+				if(step == NoMatch || step == EndOfData)
+					break;
+			}
+			if(joined) {
+				samples.insert(samples.end(), joint + 1, segment.samples.end());
+				offset      = segment.stop;
+				truncated   = segment.truncated;
+				track_order = segment.order;  // After its last sample.
+			}
+		}
+	} catch(...) {
+		freeSegments(segments);
+		throw;
+	}
+	freeSegments(segments);
+
+	if(truncated) {
+		cout << "!found\n";
+		mdat->file_end = mdat->file_begin + offset;
+		mdat->length   = mdat->file_end - mdat->file_begin;
+	}
+
+	vector<int> audiotimes;
+	for(unsigned int i = 0; i < samples.size(); ++i) {
+		const ScanIndex::Sample &sample = samples[i];
+		Track &track = tracks[sample.track];
+		if(sample.keyframe)
+			track.keyframes.push_back(track.offsets.size());
+		track.offsets.push_back(sample.offset);
+		track.sizes.push_back(sample.size);
+		if(sample.duration)
+			audiotimes.push_back(sample.duration);
+	}
+	clog << "Found " << samples.size() << " packets, " << matched << " of them matched at the joints.\n";
+
+	finishTracks(audiotimes);
+#endif
+}
+
+bool Mp4::repair(string corrupt_filename, int file_flags, string index_filename, int threads) {
+	clog << "Repair: " << corrupt_filename << '\n';
+	File *file = openCorrupt(corrupt_filename, file_flags);
+	if(file->isStream()) {
+		delete file;
+		throw "Cannot seek in file: " + corrupt_filename + " (repair it as a stream)";
+	}
+	BufferedAtom *mdat = findMdat(file);
+	try {
+		ScanIndex index;
+		if(!index_filename.empty()) {
+			vector<string> codecs;
+			for(unsigned int i = 0; i < tracks.size(); ++i)
+				codecs.push_back(tracks[i].codec.name);
+			if(!index.open(index_filename, corrupt_filename, mdat->file_begin, mdat->file_end, codecs))
+				throw "Could not open scan index: " + index_filename;
+		}
+#ifdef _WIN32
+		threads = 1;  // No pthreads.
+#else
+		if(threads <= 0)
+			threads = int(sysconf(_SC_NPROCESSORS_ONLN));
+#endif
+		if(threads > 1 && index_filename.empty())
+			scanSegments(mdat, corrupt_filename, file_flags, threads);
+		else
+			scan(mdat, NULL, index_filename.empty() ? NULL : &index);
+	} catch(...) {
+		delete mdat;
+		throw;
 	}
 
 	Atom *original_mdat = root->atomByName("mdat");
@@ -746,8 +1628,91 @@ bool Mp4::repair(string corrupt_filename) {
 	root->replace(original_mdat, mdat);
 	//original_mdat->content.swap(mdat->content);
 	//original_mdat->start = -8;
-	delete original_mdat;
+	Atom::destroy(original_mdat);
+
+	clog << endl;
+	return true;
+}
+
+
+// Repair a corrupt file writing the output as the scan proceeds, so the output
+//  is ftyp, mdat and then moov (as its sample tables are known only at the end).
+// The corrupt file can be read forward only and the output can be a pipe,
+//  "-" is stdin or stdout.
+bool Mp4::repairStream(string corrupt_filename, string output_filename, int file_flags) {
+	clog << "Repair stream: " << corrupt_filename << '\n';
+	if(!root) {
+		cerr << "No file opened.\n";
+		return false;
+	}
+
+	File *file = openCorrupt(corrupt_filename, file_flags);
+	BufferedAtom *mdat = findMdat(file);
+
+	clog << "Saving to: " << output_filename << '\n';
+	File output;
+	if(!output.create(output_filename)) {
+		delete mdat;
+		throw "Could not create file for writing: " + output_filename;
+	}
+	Atom *ftyp = root->atomByName("ftyp");
+	if(ftyp)
+		ftyp->write(output);
+	try {
+		scan(mdat, &output);
+	} catch(...) {
+		delete mdat;
+		throw;
+	}
+	delete mdat;
+
+	Atom *moov = updateMovie();
+	if(!moov)
+		return false;
+	moov->updateLength();
+	moov->write(output);
+	if(!output.flush())
+		throw "Could not write to file: " + output_filename;
+	clog << endl;
+	return true;
+}
+
+// Repair a corrupt file into a fragmented mp4: ftyp, a moov without samples
+//  and then a moof and an mdat for every fragment_keyframes keyframes.
+// Nothing is patched afterwards, the files can be streams as in repairStream().
+bool Mp4::repairFragmented(string corrupt_filename, string output_filename, int fragment_keyframes, int file_flags) {
+	clog << "Repair fragmented: " << corrupt_filename << '\n';
+	if(!root) {
+		cerr << "No file opened.\n";
+		return false;
+	}
+	Atom *moov = initMovie();
+	if(!moov)
+		return false;
+
+	File *file = openCorrupt(corrupt_filename, file_flags);
+	BufferedAtom *mdat = findMdat(file);
+
+	clog << "Saving to: " << output_filename << '\n';
+	File output;
+	if(!output.create(output_filename)) {
+		delete mdat;
+		throw "Could not create file for writing: " + output_filename;
+	}
+	Atom *ftyp = root->atomByName("ftyp");
+	if(ftyp)
+		ftyp->write(output);
+	moov->write(output);
+	try {
+		scan(mdat, &output, NULL, max(fragment_keyframes, 1));
+	} catch(...) {
+		delete mdat;
+		throw;
+	}
+	delete mdat;
 
+	if(!output.flush())
+		throw "Could not write to file: " + output_filename;
 	clog << endl;
 	return true;
 }
@@ -24,12 +24,17 @@
 
 #include <vector>
 #include <string>
+#include <iosfwd>
 
 #include "track.h"
 
 
 class Atom;
+class BufferedAtom;
+class File;
+class ScanIndex;
 struct AVFormatContext;
+struct AVCodecContext;
 
 
 class Mp4 {
@@ -40,13 +45,25 @@ public:
     Mp4();
     ~Mp4();
 
-    void open     (std::string filename);
-    bool repair   (std::string corrupt_filename);
+    // Only the atoms are read: the codec contexts are made from the sample descriptions.
+    // Probing the file with libav is needed for printMediaInfo(), or for codecs not known here.
+    void open     (std::string filename, bool probe = false);
+    // With an index file, the found samples are kept there and a later repair resumes from them.
+    // With threads > 1 (0: one per core) and no index, the mdat is scanned in segments in parallel.
+    bool repair   (std::string corrupt_filename, int file_flags = 0, std::string index_filename = "", int threads = 1);
+    // Repair straight into output, with moov last; both can be pipes ("-" for stdin/stdout).
+    bool repairStream(std::string corrupt_filename, std::string output_filename, int file_flags = 0);
+    // Repair into a fragmented mp4, with a fragment every fragment_keyframes keyframes.
+    bool repairFragmented(std::string corrupt_filename, std::string output_filename,
+                          int fragment_keyframes, int file_flags = 0);
     bool save     (std::string output_filename);
     bool saveVideo(std::string output_filename) { return save(output_filename); }
+    // Save into the repaired corrupt file, writing only the new moov.
+    bool saveInPlace(std::string corrupt_filename);
 
     void printMediaInfo();
     void printAtoms();
+    void printAtomsJson(std::ostream &out);  // A JSON array of the top level atoms.
 
     void analyze(bool interactive = true);
 
@@ -54,13 +71,27 @@ public:
 
 protected:
     std::string file_name;
+    File *source;  //the atoms of root read their content from it
     Atom *root;
-    AVFormatContext *context;
+    AVFormatContext *context;  //only if probed
+    std::vector<AVCodecContext *> contexts;  //made from the sample descriptions, if not probed
     std::vector<Track> tracks;
+    TrackOrder track_order;  //of the tracks in the scan
+    std::vector<Atom *> keyframe_traks;  //with an stss in the reference, set by initMovie(): the tracks are reordered later
 
     void close();
+    void probeFile();
+    void freeContexts();
     bool parseTracks();
     void writeTracksToAtoms();
+    Atom *updateMovie();
+    Atom *initMovie();
+
+    BufferedAtom *findMdat(File *file);
+    void prepareTracks();
+    void finishTracks(std::vector<int> &audiotimes);
+    void scan(BufferedAtom *mdat, File *output = NULL, ScanIndex *index = NULL, int fragment_keyframes = 0);
+    void scanSegments(BufferedAtom *mdat, std::string filename, int file_flags, int threads);
 };
 
 #endif // MP4_H
@@ -25,6 +25,7 @@
 //#include <iomanip>
 #include <cstring>
 #include <cassert>
+#include <algorithm>    // for: min(), max(), sort()
 
 #ifndef __STDC_LIMIT_MACROS
 # define __STDC_LIMIT_MACROS    1
@@ -150,6 +151,110 @@ namespace {
 #endif
 		}
 	};
+
+
+	// Codecs whose context can be made from the sample description alone.
+	struct EntryCodec {
+		const char  *name;
+		AVCodecID    id;
+		AVMediaType  type;
+	};
+	const EntryCodec EntryCodecs[] = {
+		{ "avc1", AV_CODEC_ID_H264,      AVMEDIA_TYPE_VIDEO },
+		{ "mp4v", AV_CODEC_ID_MPEG4,     AVMEDIA_TYPE_VIDEO },
+		{ "apcn", AV_CODEC_ID_PRORES,    AVMEDIA_TYPE_VIDEO },
+		{ "apch", AV_CODEC_ID_PRORES,    AVMEDIA_TYPE_VIDEO },
+		{ "apcs", AV_CODEC_ID_PRORES,    AVMEDIA_TYPE_VIDEO },
+		{ "apco", AV_CODEC_ID_PRORES,    AVMEDIA_TYPE_VIDEO },
+		{ "ap4h", AV_CODEC_ID_PRORES,    AVMEDIA_TYPE_VIDEO },
+		{ "mp4a", AV_CODEC_ID_AAC,       AVMEDIA_TYPE_AUDIO },
+		{ "samr", AV_CODEC_ID_AMR_NB,    AVMEDIA_TYPE_AUDIO },
+		{ "alac", AV_CODEC_ID_ALAC,      AVMEDIA_TYPE_AUDIO },
+		{ "twos", AV_CODEC_ID_PCM_S16BE, AVMEDIA_TYPE_AUDIO },
+		{ "sowt", AV_CODEC_ID_PCM_S16LE, AVMEDIA_TYPE_AUDIO }
+	};
+
+	// The ProRes flavours: their frames all start with the same header.
+	bool isProRes(const string &name) {
+		return name == "apcn" || name == "apch" || name == "apcs" || name == "apco" || name == "ap4h";
+	}
+
+	// Find a box in [p, end), also inside QuickTime 'wave' boxes; NULL if not found.
+	const uint8_t *findBox(const uint8_t *p, const uint8_t *end, const char *name) {
+		while(end - p >= 8) {
+			uint32_t size = readBE<uint32_t>(p);
+			if(size < 8 || size > uint32_t(end - p))
+				return NULL;
+			if(memcmp(p + 4, name, 4) == 0)
+				return p;
+			if(memcmp(p + 4, "wave", 4) == 0) {
+				const uint8_t *found = findBox(p + 8, p + size, name);
+				if(found)
+					return found;
+			}
+			p += size;
+		}
+		return NULL;
+	}
+
+	// Read the header of an MPEG-4 descriptor; p moves to its payload.
+	// Returns the tag, or -1 if the descriptor doesn't fit before end.
+	int readDescriptor(const uint8_t *&p, const uint8_t *end, uint32_t &size) {
+		if(p >= end)
+			return -1;
+		int tag = *p++;
+		size = 0;
+		for(int i = 0; i < 4 && p < end; ++i) {
+			uint8_t c = *p++;
+			size = (size << 7) | (c & 0x7F);
+			if(!(c & 0x80))
+				break;
+		}
+		return (size <= uint32_t(end - p)) ? tag : -1;
+	}
+
+	// The object type of the stream in an esds box, and its decoder specific info if any
+	//  (mp3 has none: info_size stays 0). Returns false without a DecoderConfigDescriptor.
+	bool parseEsds(const uint8_t *box, const uint8_t *&info, uint32_t &info_size, int &object_type) {
+		const uint8_t *p   = box + 12;  // Box header, version and flags.
+		const uint8_t *end = box + readBE<uint32_t>(box);
+		uint32_t size;
+		if(readDescriptor(p, end, size) == 3) {  // ES_Descriptor
+			if(end - p < 3)
+				return false;
+			int flags = p[2];
+			p += 3;
+			if(flags & 0x80)
+				p += 2;
+			if((flags & 0x40) && p < end)
+				p += 1 + *p;
+			if(flags & 0x20)
+				p += 2;
+		} else {
+			p += 2;
+		}
+		if(p > end || readDescriptor(p, end, size) != 4 || size < 13)  // DecoderConfigDescriptor
+			return false;
+		object_type = p[0];
+		p += 13;
+		if(readDescriptor(p, end, size) != 5)  // DecoderSpecificInfo
+			return true;
+		info      = p;
+		info_size = size;
+		return true;
+	}
+
+	// The samples of the tracks in file order.
+	struct TrackSample {
+		int64_t offset;
+		int     track;
+
+		bool operator<(const TrackSample &other) const { return offset < other.offset; }
+	};
+
+	// Samples of each track checked against the other tracks, and the bytes of each.
+	const unsigned int SampleChecks   = 64;
+	const int64_t      MaxCheckLength = 1 << 16;
 }; // namespace
 
 
@@ -486,7 +591,110 @@ void Codec::clear() {
 	mask0   = 0;
 }
 
-bool Codec::parse(Atom *trak, vector<int> &offsets, Atom *mdat) {
+AVCodecContext *Codec::newContext(Atom *trak) {
+	Atom *hdlr = trak->atomByName("hdlr");
+	Atom *stsd = trak->atomByName("stsd");
+	char type[5] = "";
+	if(hdlr)
+		hdlr->readChar(type, 8, 4);
+	if(!stsd || (type != string("soun") && type != string("vide")))
+		return avcodec_alloc_context3(NULL);  // Not used, like the streams libav doesn't know.
+
+	int64_t size = stsd->contentSize();
+	if(size < 16)
+		return NULL;
+	const uint8_t *entry = stsd->contentData(8, size - 8);
+	const uint8_t *end   = entry + min<int64_t>(readBE<uint32_t>(entry), size - 8);
+
+	const EntryCodec *known = NULL;
+	for(unsigned int i = 0; i < sizeof(EntryCodecs) / sizeof(EntryCodecs[0]); ++i) {
+		if(memcmp(entry + 4, EntryCodecs[i].name, 4) == 0)
+			known = &EntryCodecs[i];
+	}
+	if(!known)
+		return NULL;
+
+	AVCodecContext *context = avcodec_alloc_context3(NULL);
+	if(!context)
+		throw string("Could not create codec context");
+	context->codec_id   = known->id;
+	context->codec_type = known->type;
+	context->codec_tag  = entry[4] | (entry[5] << 8) | (entry[6] << 16) | (unsigned(entry[7]) << 24);
+
+	// The sample entry fields before its boxes.
+	const uint8_t *boxes = end;
+	if(known->type == AVMEDIA_TYPE_VIDEO && end - entry >= 86) {
+		context->width  = readBE<uint16_t>(entry + 32);
+		context->height = readBE<uint16_t>(entry + 34);
+		context->bits_per_coded_sample = readBE<uint16_t>(entry + 82);
+		boxes = entry + 86;
+	} else if(known->type == AVMEDIA_TYPE_AUDIO && end - entry >= 36) {
+		int version = readBE<uint16_t>(entry + 16);
+		context->channels              = readBE<uint16_t>(entry + 24);
+		context->bits_per_coded_sample = readBE<uint16_t>(entry + 26);
+		context->sample_rate           = readBE<uint32_t>(entry + 32) >> 16;
+		boxes = entry + 36;
+		if(version == 1 && end - entry >= 52) {
+			boxes = entry + 52;
+		} else if(version == 2 && end - entry >= 72) {
+			uint64_t rate = readBE<uint64_t>(entry + 40);
+			double   sample_rate;
+			memcpy(&sample_rate, &rate, sizeof(sample_rate));
+			context->sample_rate           = int(sample_rate);
+			context->channels              = readBE<uint32_t>(entry + 48);
+			context->bits_per_coded_sample = readBE<uint32_t>(entry + 56);
+			boxes = entry + 72;
+		}
+	}
+
+	// Extradata: the configuration the decoder needs before the first sample.
+	const uint8_t *extra      = NULL;
+	uint32_t       extra_size = 0;
+	if(known->id == AV_CODEC_ID_H264) {
+		const uint8_t *avcC = findBox(boxes, end, "avcC");
+		if(avcC) {
+			extra      = avcC + 8;
+			extra_size = readBE<uint32_t>(avcC) - 8;
+		}
+	} else if(known->id == AV_CODEC_ID_MPEG4 || known->id == AV_CODEC_ID_AAC) {
+		const uint8_t *esds = findBox(boxes, end, "esds");
+		int object_type = 0;
+		if(esds && parseEsds(esds, extra, extra_size, object_type)
+				&& (object_type == 0x69 || object_type == 0x6B))
+			context->codec_id = AV_CODEC_ID_MP3;  // mp3 in mp4a.
+	} else if(known->id == AV_CODEC_ID_ALAC) {
+		const uint8_t *alac = findBox(boxes, end, "alac");  // The decoder wants the whole box.
+		if(alac) {
+			extra      = alac;
+			extra_size = readBE<uint32_t>(alac);
+		}
+	}
+	if(extra_size) {
+		context->extradata = static_cast<uint8_t*>(av_mallocz(extra_size + AV_INPUT_BUFFER_PADDING_SIZE));
+		if(!context->extradata) {
+			avcodec_free_context(&context);
+			throw string("Could not allocate codec extradata");
+		}
+		memcpy(context->extradata, extra, extra_size);
+		context->extradata_size = extra_size;
+	}
+	return context;
+}
+
+void Codec::open() {
+	if(!context)
+		throw string("No codec context.");
+	AvLog useAvLog();
+	codec = avcodec_find_decoder(context->codec_id);
+	if(!codec)
+		throw string("No codec found!");
+	if(avcodec_open2(context, codec, NULL) < 0) {
+		throw string("Could not open codec: ")
+			+ ((context->codec && context->codec->name)? context->codec->name : "???");
+	}
+}
+
+bool Codec::parse(Atom *trak, vector<int64_t> &offsets, Atom *mdat) {
 	Atom *stsd = trak->atomByName("stsd");
 	if(!stsd) {
 		cerr << "Missing 'Sample Descriptions' atom (stsd).\n";
@@ -505,7 +713,7 @@ bool Codec::parse(Atom *trak, vector<int> &offsets, Atom *mdat) {
 	mask0 = 0xffffffff;
 	// Build the mask:
 	for(unsigned int i = 0; i < offsets.size(); i++) {
-		int offset = offsets[i];
+		int64_t offset = offsets[i];
 		if(offset < mdat->start || offset - mdat->start > mdat->length)
 			throw string("Invalid offset in track!");
 
@@ -633,7 +841,7 @@ bool Codec::matchSample(const unsigned char *start, int maxlength) {
 		throw "Encountered an EVIL audio codec";
 		return true;
 
-	} else if(name == "apcn") {
+	} else if(isProRes(name)) {
 		return memcmp(start, "icpf", 4) == 0;
 
 	} else if(name == "lpcm") {
@@ -656,7 +864,7 @@ bool Codec::matchSample(const unsigned char *start, int maxlength) {
 }
 
 
-int Codec::getLength(unsigned char *start, int maxlength, int &duration) {
+int Codec::getLength(const unsigned char *start, int maxlength, int &duration) {
 	if(name == "mp4a") {
 		if(!context)
 			return -1;
@@ -668,7 +876,7 @@ int Codec::getLength(unsigned char *start, int maxlength, int &duration) {
 				throw string("Could not create AVFrame");
 			AVPacket avp;
 			av_init_packet(&avp);
-			avp.data = start;
+			avp.data = const_cast<unsigned char*>(start);  // Not modified by decoders.
 			avp.size = maxlength;
 			int got_frame = 0;
 			consumed = avcodec_decode_audio4(context, frame, &got_frame, &avp);
@@ -707,7 +915,7 @@ int Codec::getLength(unsigned char *start, int maxlength, int &duration) {
 				throw string("Could not create AVFrame");
 			AVPacket avp;
 			av_init_packet(&avp);
-			avp.data = start;
+			avp.data = const_cast<unsigned char*>(start);  // Not modified by decoders.
 			avp.size = maxlength;
 			int got_frame = 0;
 			consumed = avcodec_decode_video2(context, frame, &got_frame, &avp);
@@ -757,7 +965,7 @@ int Codec::getLength(unsigned char *start, int maxlength, int &duration) {
 				throw string("Could not create AVFrame");
 			AVPacket avp;
 			av_init_packet(&avp);
-			avp.data = start;
+			avp.data = const_cast<unsigned char*>(start);  // Not modified by decoders.
 			avp.size = maxlength;
 			int got_frame = 0;
 			consumed = avcodec_decode_video2(context, frame, &got_frame, &avp);
@@ -904,7 +1112,7 @@ int Codec::getLength(unsigned char *start, int maxlength, int &duration) {
 		// Lenght is a multiple of 32, we split packets.
 		return 4;
 
-	} else if(name == "apcn") {
+	} else if(isProRes(name)) {
 		return readBE<int32_t>(start);
 
 	} else if(name == "lpcm") {
@@ -965,8 +1173,8 @@ bool Track::parse(Atom *t, Atom *mdat) {
 	keyframes = getKeyframes  (t);
 	sizes     = getSampleSizes(t);
 
-	vector<int> chunk_offsets   = getChunkOffsets(t);
-	vector<int> sample_to_chunk = getSampleToChunk(t, chunk_offsets.size());
+	vector<int64_t> chunk_offsets   = getChunkOffsets(t);
+	vector<int>     sample_to_chunk = getSampleToChunk(t, chunk_offsets.size());
 
 	if(times.size() != sizes.size()) {
 		clog << "Mismatch between time offsets and size offsets.\n";
@@ -979,7 +1187,7 @@ bool Track::parse(Atom *t, Atom *mdat) {
 	}
 	// Compute actual offsets.
 	int old_chunk = -1;
-	int offset = -1;
+	int64_t offset = -1;
 	for(unsigned int i = 0; i < sizes.size(); i++) {
 		int chunk = sample_to_chunk[i];
 		int size = sizes[i];
@@ -1009,18 +1217,7 @@ bool Track::parse(Atom *t, Atom *mdat) {
 
 	// Move this to Codec.
 	codec.parse(trak, offsets, mdat);
-	if(!codec.context)
-		throw string("No codec context.");
-	{
-		AvLog useAvLog();
-		codec.codec = avcodec_find_decoder(codec.context->codec_id);
-		if(!codec.codec)
-			throw string("No codec found!");
-		if(avcodec_open2(codec.context, codec.codec, NULL) < 0) {
-			throw string("Could not open codec: ")
-				+ ((codec.context->codec && codec.context->codec->name)? codec.context->codec->name : "???");
-		}
-	}
+	codec.open();
 
 #if 0
 	if(!mdat)
@@ -1105,6 +1302,36 @@ void Track::writeToAtoms() {
 
 }
 
+void Track::writeEmptyTables() {
+	if(!trak)
+		return;
+
+	trak->prune("stss");
+	const char *tables[] = { "stts", "stsc", "stco", "co64" };
+	for(unsigned int i = 0; i < sizeof(tables)/sizeof(tables[0]); i++) {
+		Atom *table = trak->atomByName(tables[i]);
+		if(!table)
+			continue;
+		table->contentResize(4 +           //version
+							  4);           //entries
+		table->writeInt(0, 0);
+		table->writeInt(0, 4);
+	}
+	Atom *stsz = trak->atomByName("stsz");
+	if(stsz) {
+		stsz->contentResize(4 +             //version
+							4 +             //default size
+							4);             //entries
+		stsz->writeInt(0, 0);
+		stsz->writeInt(0, 4);
+		stsz->writeInt(0, 8);
+	}
+
+	Atom *mdhd = trak->atomByName("mdhd");
+	if(mdhd)
+		mdhd->writeInt(0, 16);
+}
+
 void Track::clear() {
 	offsets.clear();
 	sizes.clear();
@@ -1179,15 +1406,15 @@ vector<int> Track::getSampleSizes(Atom *t) {
 	return sample_sizes;
 }
 
-vector<int> Track::getChunkOffsets(Atom *t) {
+vector<int64_t> Track::getChunkOffsets(Atom *t) {
 	assert(t != NULL);
-	vector<int> chunk_offsets;
+	vector<int64_t> chunk_offsets;
 	// Chunk offsets.
 	Atom *stco = t->atomByName("stco");
 	if(stco) {
 		int32_t nchunks = stco->readInt(4);
 		for(int i = 0; i < nchunks; i++)
-			chunk_offsets.push_back(stco->readInt(8 + i*4));
+			chunk_offsets.push_back(uint32_t(stco->readInt(8 + i*4)));
 
 	} else {
 		Atom *co64 = t->atomByName("co64");
@@ -1196,13 +1423,9 @@ vector<int> Track::getChunkOffsets(Atom *t) {
 
 		int32_t nchunks = co64->readInt(4);
 		for(int i = 0; i < nchunks; i++) {
-			int32_t hi32 = co64->readInt( 8 + i*8); //high order 32-bits
-			int32_t lo32 = co64->readInt(12 + i*8); //low  order 32-bits
-			if(hi32 != 0) {
-				cerr << "Overflow: 64-bit Chunk Offset value too large ("
-					<< ((int64_t(hi32) << 32) | uint32_t(lo32)) << ").\n";
-			}
-			chunk_offsets.push_back(lo32);
+			uint32_t hi32 = co64->readInt( 8 + i*8); //high order 32-bits
+			uint32_t lo32 = co64->readInt(12 + i*8); //low  order 32-bits
+			chunk_offsets.push_back((int64_t(hi32) << 32) | lo32);
 		}
 	}
 	return chunk_offsets;
@@ -1244,9 +1467,9 @@ void Track::saveSampleTimes() {
 	assert(stts);
 	if(!stts)
 		return;
-	stts->content.resize(4 +                //version
-						 4 +                //entries
-						 8*times.size());   //time table
+	stts->contentResize(4 +                //version
+						4 +                //entries
+						8*times.size());   //time table
 	stts->writeInt(times.size(), 4);
 	for(unsigned int i = 0; i < times.size(); i++) {
 		stts->writeInt(1, 8 + 8*i);
@@ -1264,9 +1487,9 @@ void Track::saveKeyframes() {
 	if(keyframes.empty())
 		return;
 
-	stss->content.resize(4 +                  //version
-						 4 +                  //entries
-						 4*keyframes.size()); //time table
+	stss->contentResize(4 +                  //version
+						4 +                  //entries
+						4*keyframes.size()); //time table
 	stss->writeInt(keyframes.size(), 4);
 	for(unsigned int i = 0; i < keyframes.size(); i++)
 		stss->writeInt(keyframes[i] + 1, 8 + 4*i);
@@ -1279,10 +1502,10 @@ void Track::saveSampleSizes() {
 	assert(stsz);
 	if(!stsz)
 		return;
-	stsz->content.resize(4 +                //version
-						 4 +                //default size
-						 4 +                //entries
-						 4*sizes.size());   //size table
+	stsz->contentResize(4 +                //version
+						4 +                //default size
+						4 +                //entries
+						4*sizes.size());   //size table
 	stsz->writeInt(0, 4);
 	stsz->writeInt(sizes.size(), 8);
 	for(unsigned int i = 0; i < sizes.size(); i++)
@@ -1296,38 +1519,166 @@ void Track::saveSampleToChunk() {
 	assert(stsc);
 	if(!stsc)
 		return;
-	stsc->content.resize(4 +                //version
-						 4 +                //number of entries
-						 12);               //one sample per chunk.
+	stsc->contentResize(4 +                //version
+						4 +                //number of entries
+						12);               //one sample per chunk.
 	stsc->writeInt(1,  4);
 	stsc->writeInt(1,  8);                  //first chunk (1 based)
 	stsc->writeInt(1, 12);                  //one sample per chunk
 	stsc->writeInt(1, 16);                  //id 1 (WHAT IS THIS!)
 }
 
+// Use 32-bit offsets (stco) if they fit, for a smaller moov, 64-bit (co64) otherwise.
 void Track::saveChunkOffsets() {
 	if(!trak)
 		return;
-	Atom *co64 = trak->atomByName("co64");
-	if(co64) {
-		trak->prune("co64");
+	bool large = false;
+	for(unsigned int i = 0; i < offsets.size() && !large; i++)
+		large = (offsets[i] > int64_t(UINT32_MAX));
+
+	const char *name  = large ? "co64" : "stco";
+	const char *other = large ? "stco" : "co64";
+	if(trak->atomByName(other)) {
+		trak->prune(other);
 		Atom *stbl = trak->atomByName("stbl");
-		if(stbl) {
-			Atom *new_stco = new Atom;
-			memcpy(new_stco->name, "stco", min(sizeof("stco"), sizeof(new_stco->name)-1));
-			stbl->children.push_back(new_stco);
+		if(stbl && !trak->atomByName(name)) {
+			stbl->addChild(name);
+		}
+	}
+	Atom *co = trak->atomByName(name);
+	assert(co);
+	if(!co)
+		return;
+	int entry = large ? 8 : 4;
+	co->contentResize(4 +                  //version
+					  4 +                  //number of entries
+					  entry*offsets.size());
+	co->writeInt(offsets.size(), 4);
+	for(unsigned int i = 0; i < offsets.size(); i++) {
+		if(large)
+			co->writeInt64(offsets[i], 8 + 8*i);
+		else
+			co->writeInt(uint32_t(offsets[i]), 8 + 4*i);
+	}
+}
+
+
+
+// TrackOrder.
+TrackOrder::TrackOrder() : last(-1), run(0) { }
+
+void TrackOrder::learn(vector<Track> &tracks, Atom *mdat) {
+	int count = int(tracks.size());
+	fixed.resize(count);
+	for(int i = 0; i < count; ++i)
+		fixed[i] = i;
+	orders.clear();
+	last = -1;
+	run  = 0;
+
+	vector<TrackSample> samples;
+	for(int i = 0; i < count; ++i) {
+		for(unsigned int j = 0; j < tracks[i].offsets.size(); ++j) {
+			TrackSample sample = { tracks[i].offsets[j], i };
+			samples.push_back(sample);
 		}
 	}
-	Atom *stco = trak->atomByName("stco");
-	assert(stco);
-	if(!stco)
+	if(count < 2 || samples.empty())
 		return;
-	stco->content.resize(4 +                //version
-						 4 +                //number of entries
-						 4*offsets.size());
-	stco->writeInt(offsets.size(), 4);
-	for(unsigned int i = 0; i < offsets.size(); i++)
-		stco->writeInt(offsets[i], 8 + 4*i);
+	sort(samples.begin(), samples.end());
+
+	// Which tracks match the samples of which others: they can't be tried before them.
+	vector<vector<bool> > confused(count, vector<bool>(count, mdat == NULL));
+	for(int i = 0; mdat && i < count; ++i) {
+		const Track &track = tracks[i];
+		unsigned int step = max<size_t>(1, track.offsets.size() / SampleChecks);
+		for(unsigned int j = 0; j < track.offsets.size(); j += step) {
+			int64_t offset = track.offsets[j] - mdat->start - 8;
+			int64_t size   = min<int64_t>(track.sizes[j], MaxCheckLength);
+			if(offset < 0 || size <= 0 || offset + size > mdat->contentSize())
+				continue;
+			vector<char> data(size + 1);
+			mdat->readChar(&data[0], offset, size);
+			const unsigned char *start = reinterpret_cast<const unsigned char*>(&data[0]);
+			for(int k = 0; k < count; ++k) {
+				if(k == i || confused[k][i])
+					continue;
+				try {
+					confused[k][i] = tracks[k].codec.matchSample(start, int(size));
+				} catch(...) {
+					confused[k][i] = true;
+				}
+			}
+		}
+	}
+
+	// How often each track follows each state.
+	vector<vector<int> > counts(count * MaxRun, vector<int>(count, 0));
+	for(unsigned int i = 0; i < samples.size(); ++i) {
+		if(last >= 0)
+			counts[state()][samples[i].track]++;
+		found(samples[i].track);
+	}
+	last = -1;
+	run  = 0;
+
+	// The most frequent track first, of those that don't match the samples of the ones left.
+	orders.resize(counts.size());
+	for(unsigned int s = 0; s < counts.size(); ++s) {
+		vector<bool> tried(count, false);
+		for(int n = 0; n < count; ++n) {
+			int best = -1;
+			for(int i = 0; i < count; ++i) {
+				if(tried[i])
+					continue;
+				bool safe = true;
+				for(int k = 0; k < count; ++k) {
+					if(k != i && !tried[k] && confused[i][k])
+						safe = false;
+				}
+				if(safe && (best < 0 || counts[s][i] > counts[s][best]))
+					best = i;
+			}
+			for(int i = 0; best < 0; ++i) {
+				if(!tried[i])
+					best = i;
+			}
+			tried[best] = true;
+			orders[s].push_back(best);
+		}
+	}
+
+#ifdef VERBOSE1
+	clog << "Track order after each track:";
+	for(int i = 0; i < count; ++i) {
+		clog << ' ' << i << ':';
+		for(int j = 0; j < count; ++j)
+			clog << orders[i * MaxRun][j];
+	}
+	clog << '\n';
+#endif
+}
+
+const vector<int> &TrackOrder::next() const {
+	if(last < 0 || orders.empty())
+		return fixed;
+	return orders[state()];
+}
+
+void TrackOrder::found(int track) {
+	if(track == last) {
+		++run;
+	} else {
+		last = track;
+		run  = 1;
+	}
+	if(run > MaxRun)
+		run = MaxRun;  // Don't overflow.
+}
+
+void TrackOrder::reset() {
+	last = -1;
+	run  = 0;
 }
 
 // vim:set ts=4 sw=4 sts=4 noet:
@@ -25,6 +25,9 @@
 
 #include <vector>
 #include <string>
+extern "C" {
+#include <stdint.h>
+}
 
 
 class Atom;
@@ -40,12 +43,17 @@ public:
 
     Codec();
 
-    bool parse(Atom *trak, std::vector<int> &offsets, Atom *mdat);
+    bool parse(Atom *trak, std::vector<int64_t> &offsets, Atom *mdat);
+    void open();  //the decoder for the context
     void clear();
 
+    // A context for the codec of trak made from its sample description, without probing the file.
+    // Returns NULL if the codec is not known; the caller frees the context.
+    static AVCodecContext *newContext(Atom *trak);
+
     bool matchSample(const unsigned char *start, int maxlength);
     bool isKeyframe (const unsigned char *start, int maxlength);
-    int  getLength  (      unsigned char *start, int maxlength, int &duration);
+    int  getLength  (const unsigned char *start, int maxlength, int &duration);
 
 private:
     // Used by mp4a.
@@ -64,13 +72,14 @@ public:
     std::vector<int> times;
     std::vector<int> keyframes; // 0 based!
     std::vector<int> sizes;
-    std::vector<int> offsets;   // Should be 64-bit!
+    std::vector<int64_t> offsets;
 
     Track();
 
     bool parse(Atom *trak, Atom *mdat);
     void clear();
     void writeToAtoms();
+    void writeEmptyTables();  // For the moov of a fragmented file: the samples are in the fragments.
     void fixTimes();
 
 protected:
@@ -79,7 +88,7 @@ protected:
     std::vector<int> getSampleTimes  (Atom *t);
     std::vector<int> getKeyframes    (Atom *t);
     std::vector<int> getSampleSizes  (Atom *t);
-    std::vector<int> getChunkOffsets (Atom *t);
+    std::vector<int64_t> getChunkOffsets(Atom *t);
     std::vector<int> getSampleToChunk(Atom *t, int nchunks);
 
     void saveSampleTimes();
@@ -89,4 +98,33 @@ protected:
     void saveChunkOffsets();
 };
 
+
+// The order to try the tracks in for the next sample of a scan, the most probable first.
+// A Markov chain on (track of the last sample, samples of it in a row), learned from
+//  the interleaving of the samples in the reference file.
+// A track goes before another only if it doesn't match the samples of the other in
+//  the reference file, else they keep their order.
+// Copies share nothing, each scan keeps its own last samples.
+class TrackOrder {
+public:
+    TrackOrder();
+
+    void learn(std::vector<Track> &tracks, Atom *mdat);  //from their samples in mdat
+    bool learned() const { return !orders.empty(); }
+
+    const std::vector<int> &next() const;
+    void found(int track);
+    void reset();  //the last samples are not known
+
+protected:
+    static const int MaxRun = 16;  //longer runs are all alike
+
+    std::vector<int> fixed;                 //the track order, without a last sample
+    std::vector<std::vector<int> > orders;  //per last track and run
+    int last;
+    int run;
+
+    int state() const { return last * MaxRun + run - 1; }
+};
+
 #endif // TRACK_H
@@ -18,12 +18,14 @@ SOURCES += main.cpp \
     atom.cpp \
     mp4.cpp \
     file.cpp \
+    index.cpp \
     track.cpp
 
 HEADERS += \
     atom.h \
     mp4.h \
     file.h \
+    index.h \
     track.h \
     AP_AtomDefinitions.h
 
@@ -38,7 +40,7 @@ LIBS += ../libav-12.3/libavformat/libavformat.a \
 #LIBS += -L/usr/local/lib -lavformat -lavcodec -lavutil
 DEFINES += _FILE_OFFSET_BITS=64 VERBOSE VERBOSE1
 
-LIBS += -lz
+LIBS += -lz -lpthread
 
 #QMAKE_LFLAGS += -static
 #LIBS += /usr/lib/x86_64-linux-gnu/libavcodec.a \